@@ -30,8 +30,12 @@
 #include <cstdint>
 #include <iostream>
 #include <array>
+#include <functional>
+#include <map>
 #include <vector>
 #include <memory>
+#include <stdexcept>
+#include <string>
 
 /* Dependencies namespaces */
 namespace spdlog {
@@ -40,8 +44,9 @@ class logger;
 
 namespace cryptodiff {
 
-enum WeakHashType : uint8_t {RSYNC=0/*, RSYNC64=1*/};
-enum StrongHashType : uint8_t {SHA3_224=0, SHA2_224=1};
+enum WeakHashType : uint8_t {RSYNC=0, RSYNC64=1};
+enum StrongHashType : uint8_t {SHA3_224=0, SHA2_224=1, BLAKE2B_224=2};
+enum ChunkingType : uint8_t {FIXED=0, FASTCDC=1};
 
 void CRYPTODIFF_EXPORTED set_logger(std::shared_ptr<spdlog::logger> logger);
 
@@ -50,14 +55,20 @@ std::vector<uint8_t> CRYPTODIFF_EXPORTED decrypt_block(const std::vector<uint8_t
 
 std::vector<uint8_t> CRYPTODIFF_EXPORTED compute_strong_hash(const std::vector<uint8_t>& data, StrongHashType type);
 
+/**
+ * Pull-style data source. Must fill buffer with up to size bytes and return the number of bytes written.
+ * Returning 0 means end of data.
+ */
+using ReadCallback = std::function<size_t(uint8_t* buffer, size_t size)>;
+
 struct error : std::runtime_error {
 	error(const char* what) : std::runtime_error(what) {}
 	error() : error("Cryptodiff error") {}
 };
 
 struct CRYPTODIFF_EXPORTED Block {
-	std::vector<uint8_t> encrypted_data_hash_;	// >=28 bytes; =28 bytes with SHA3_224 or SHA2_224
-	std::vector<uint8_t> encrypted_rsync_hashes_;	// >=32 bytes
+	std::vector<uint8_t> encrypted_data_hash_;	// >=28 bytes; =28 bytes with SHA3_224, SHA2_224 or BLAKE2B_224
+	std::vector<uint8_t> encrypted_rsync_hashes_;	// >=32 bytes; =32 bytes with RSYNC, =48 bytes with RSYNC64
 	uint32_t blocksize_;	// 4 bytes.
 	std::vector<uint8_t> iv_;	// =16 bytes, IV is being reused as decrypted_hashes_part is considered not equal plaintext's first 32 bytes
 };
@@ -66,9 +77,10 @@ class CRYPTODIFF_EXPORTED EncFileMap {
 public:
 	EncFileMap();
 	EncFileMap(const EncFileMap& encfilemap);
-	EncFileMap(EncFileMap&& encfilemap);
+	// Moving doesn't allocate. A moved-from map may only be assigned to or destroyed.
+	EncFileMap(EncFileMap&& encfilemap) noexcept;
 	EncFileMap& operator=(const EncFileMap& encfilemap);
-	EncFileMap& operator=(EncFileMap&& encfilemap);
+	EncFileMap& operator=(EncFileMap&& encfilemap) noexcept;
 	virtual ~EncFileMap();
 
 	std::vector<Block> delta(const EncFileMap& old_filemap);
@@ -82,30 +94,135 @@ public:
 	uint32_t minblocksize() const;
 	StrongHashType strong_hash_type() const;
 	WeakHashType weak_hash_type() const;
+	ChunkingType chunking_type() const;
+
+	// Serialization. Versioned binary format with fixed-width block records. load() memory-maps the file.
+	std::vector<uint8_t> serialize() const;
+	void deserialize(const std::vector<uint8_t>& serialized);
+	void deserialize(const uint8_t* data, size_t size);
+	void save(const std::string& path) const;
+	void load(const std::string& path);
 
 	// Setters
+	// Blocks must have encrypted hashes of the current weak hash type, so set it first. Throws on mismatch.
 	void set_blocks(const std::vector<Block>&);
 	void set_maxblocksize(uint32_t);
 	void set_minblocksize(uint32_t);
 	void set_strong_hash_type(StrongHashType);
 	void set_weak_hash_type(WeakHashType);
+	void set_chunking_type(ChunkingType);
 
 	/* implementation */
 	inline void* get_implementation(){return pImpl;}
 
 protected:
+	EncFileMap(void* impl);	// Takes ownership of impl
 	void* pImpl;
 };
 
+class BlockIndex;
+
 class CRYPTODIFF_EXPORTED FileMap : public EncFileMap {
 protected:
 	FileMap();
+	FileMap(void* impl);	// Takes ownership of impl
 public:
 	FileMap(std::vector<uint8_t> key);
+	// Copies share blocks with the original, so they are cheap. Moves are as in EncFileMap.
+	FileMap(const FileMap& filemap) = default;
+	FileMap(FileMap&& filemap) = default;
+	FileMap& operator=(const FileMap& filemap) = default;
+	FileMap& operator=(FileMap&& filemap) = default;
 	virtual ~FileMap();
 
 	void create(const std::string& datafile);
+	// Returns map of the new version of datafile. This map is left unchanged.
 	FileMap update(const std::string& datafile);
+	// Same, when only dirty_ranges (offset, length) of datafile were modified. File may also have been truncated or
+	// extended, its new size is taken from datafile. Blocks outside of dirty ranges are kept without being read.
+	FileMap update(const std::string& datafile, const std::vector<std::pair<uint64_t, uint64_t>>& dirty_ranges);
+
+	// Streaming variants. Data is read in one forward pass, using memory bounded by block size, not data size.
+	void create(std::istream& datastream);
+	void create(const ReadCallback& read);
+	FileMap update(std::istream& datastream);
+	FileMap update(const ReadCallback& read);
+
+	// Number of worker threads, used for block signing. Defaults to the number of hardware threads.
+	unsigned concurrency() const;
+	void set_concurrency(unsigned);
+
+	// Limit for file data being read, matched and signed at once, in bytes. 0 (default) means no limit. When the limit
+	// is reached, reading waits for blocks in flight to be signed. At least one block is always in flight.
+	// Counted are buffers of blocks being read and signed, read-ahead buffers of create() and update() (with streams
+	// too), and scanning buffers of update(). Not counted is block metadata: block signatures, and the index of old
+	// blocks, which update() builds. It grows with the number of blocks, by a few hundred bytes per block.
+	// Maps produced by update() share the limit with this map. If the prototype of a BatchSigner has a limit, all of its
+	// files share it, otherwise old maps of BatchSigner::update() keep their own.
+	uint64_t inflight_data_limit() const;
+	void set_inflight_data_limit(uint64_t);
+
+	// New blocks are taken from index, if it has a block with the same contents. Maps produced by update() use it too.
+	void set_block_index(const BlockIndex& index);
+	void reset_block_index();
+
+	friend class BatchSigner;
+	friend class BlockIndex;
+};
+
+/**
+ * Distinct blocks of many maps, so blocks with the same contents are shared between files instead of being signed and
+ * uploaded again. Key and hash types are taken from prototype, and only maps with the same ones can be added or use the
+ * index. Copies of BlockIndex refer to the same index. Safe to use from multiple threads.
+ */
+class CRYPTODIFF_EXPORTED BlockIndex {
+public:
+	BlockIndex(const FileMap& prototype);
+	BlockIndex(const BlockIndex& index);
+	BlockIndex& operator=(const BlockIndex& index);
+	~BlockIndex();
+
+	void add(const FileMap& map);
+	uint64_t size() const;	// Number of distinct blocks
+
+	// Same format as EncFileMap serialization. Signatures with other hash types than prototype's are rejected.
+	std::vector<uint8_t> serialize() const;
+	void deserialize(const std::vector<uint8_t>& serialized);
+	void save(const std::string& path) const;
+	void load(const std::string& path);
+
+	friend class FileMap;
+
+private:
+	void* pImpl;	// std::shared_ptr<internals::BlockIndex>
+};
+
+/**
+ * Creates or updates maps of many files at once, on one shared worker pool. Suited for trees of many small files:
+ * files are processed concurrently, each one on a single worker thread. A single large file gets no parallelism here,
+ * so it is better signed with FileMap::create() or FileMap::update() directly.
+ */
+class CRYPTODIFF_EXPORTED BatchSigner {
+public:
+	// New maps get key, parameters and concurrency of prototype. Blocks of prototype are not used. Maps returned by
+	// update() keep concurrency of their old maps.
+	BatchSigner(const FileMap& prototype);
+	BatchSigner(const BatchSigner&) = delete;
+	BatchSigner& operator=(const BatchSigner&) = delete;
+	~BatchSigner();
+
+	// Maps are returned in order of paths
+	std::vector<FileMap> create(const std::vector<std::string>& paths);
+	std::vector<FileMap> update(const std::vector<FileMap>& old_maps, const std::vector<std::string>& paths);
+
+	// All regular files under directory, recursively. Keys are file paths.
+	std::map<std::string, FileMap> create_directory(const std::string& directory);
+
+	unsigned concurrency() const;
+	void set_concurrency(unsigned);
+
+private:
+	void* pImpl;
 };
 
 } /* namespace filemap */
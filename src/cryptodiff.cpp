@@ -15,6 +15,8 @@
  */
 #include "impl/EncFileMap.h"
 #include "impl/FileMap.h"
+#include "impl/BatchSigner.h"
+#include "impl/BlockIndex.h"
 
 namespace cryptodiff {
 
@@ -31,29 +33,31 @@ std::vector<uint8_t> decrypt_block(const std::vector<uint8_t>& datablock, uint32
 }
 
 std::vector<uint8_t> compute_strong_hash(const std::vector<uint8_t>& data, StrongHashType type) {
-	switch(type){
-		case SHA3_224: return data | crypto::SHA3(224);
-		case SHA2_224: return data | crypto::SHA2(224);
-		default: return std::vector<uint8_t>();	// TODO: throw some exception.
-	}
+	auto strong_hash = internals::compute_strong_hash(data.data(), data.size(), type);
+	return std::vector<uint8_t>(strong_hash.begin(), strong_hash.end());
 }
 
 /* EncFileMap */
 EncFileMap::EncFileMap(){
 	pImpl = new internals::EncFileMap();
 }
+EncFileMap::EncFileMap(void* impl) : pImpl(impl) {}
 EncFileMap::EncFileMap(const EncFileMap& encfilemap){
-	pImpl = new internals::EncFileMap(*reinterpret_cast<internals::EncFileMap*>(encfilemap.pImpl));
+	// Implementation may be internals::FileMap, so it is cloned, not copy-constructed as internals::EncFileMap.
+	pImpl = encfilemap.pImpl ? reinterpret_cast<internals::EncFileMap*>(encfilemap.pImpl)->clone() : nullptr;
 }
-EncFileMap::EncFileMap(EncFileMap&& encfilemap){
+EncFileMap::EncFileMap(EncFileMap&& encfilemap) noexcept : pImpl(nullptr) {
 	std::swap(pImpl, encfilemap.pImpl);
 }
 EncFileMap& EncFileMap::operator=(const EncFileMap& encfilemap){
-	delete reinterpret_cast<internals::EncFileMap*>(pImpl);
-	pImpl = new internals::EncFileMap(*reinterpret_cast<internals::EncFileMap*>(pImpl));
+	if(this != &encfilemap){
+		void* new_impl = encfilemap.pImpl ? reinterpret_cast<internals::EncFileMap*>(encfilemap.pImpl)->clone() : nullptr;
+		delete reinterpret_cast<internals::EncFileMap*>(pImpl);
+		pImpl = new_impl;
+	}
 	return *this;
 }
-EncFileMap& EncFileMap::operator=(EncFileMap&& encfilemap){
+EncFileMap& EncFileMap::operator=(EncFileMap&& encfilemap) noexcept {
 	std::swap(pImpl, encfilemap.pImpl);
 	return *this;
 }
@@ -89,6 +93,26 @@ StrongHashType EncFileMap::strong_hash_type() const {
 WeakHashType EncFileMap::weak_hash_type() const {
 	return reinterpret_cast<internals::EncFileMap*>(pImpl)->weak_hash_type();
 }
+ChunkingType EncFileMap::chunking_type() const {
+	return reinterpret_cast<internals::EncFileMap*>(pImpl)->chunking_type();
+}
+
+/* Serialization */
+std::vector<uint8_t> EncFileMap::serialize() const {
+	return reinterpret_cast<internals::EncFileMap*>(pImpl)->serialize();
+}
+void EncFileMap::deserialize(const std::vector<uint8_t>& serialized) {
+	deserialize(serialized.data(), serialized.size());
+}
+void EncFileMap::deserialize(const uint8_t* data, size_t size) {
+	reinterpret_cast<internals::EncFileMap*>(pImpl)->deserialize(data, size);
+}
+void EncFileMap::save(const std::string& path) const {
+	reinterpret_cast<internals::EncFileMap*>(pImpl)->save(path);
+}
+void EncFileMap::load(const std::string& path) {
+	reinterpret_cast<internals::EncFileMap*>(pImpl)->load(path);
+}
 
 /* Setters */
 void EncFileMap::set_blocks(const std::vector<Block>& new_blocks) {
@@ -106,26 +130,134 @@ void EncFileMap::set_strong_hash_type(StrongHashType new_strong_hash_type) {
 void EncFileMap::set_weak_hash_type(WeakHashType new_weak_hash_type) {
 	reinterpret_cast<internals::EncFileMap*>(pImpl)->set_weak_hash_type(new_weak_hash_type);
 }
+void EncFileMap::set_chunking_type(ChunkingType new_chunking_type) {
+	reinterpret_cast<internals::EncFileMap*>(pImpl)->set_chunking_type(new_chunking_type);
+}
 
 /* FileMap */
-FileMap::FileMap() {
-	pImpl = nullptr;
-}
+FileMap::FileMap() : EncFileMap(nullptr) {}
+FileMap::FileMap(void* impl) : EncFileMap(impl) {}
 
-FileMap::FileMap(std::vector<uint8_t> key) {
-	pImpl = new internals::FileMap(std::move(key));
-}
+FileMap::FileMap(std::vector<uint8_t> key) : EncFileMap(new internals::FileMap(std::move(key))) {}
 FileMap::~FileMap(){}
 
 void FileMap::create(const std::string& datafile) {
 	reinterpret_cast<internals::FileMap*>(pImpl)->create(datafile);
 }
 FileMap FileMap::update(const std::string& datafile) {
-	FileMap new_map;
-	auto new_internal = new internals::FileMap(reinterpret_cast<internals::FileMap*>(pImpl)->update(datafile));
-	std::swap(*reinterpret_cast<internals::FileMap*>(pImpl), *new_internal);
-	delete new_internal;
-	return new_map;
+	return FileMap(new internals::FileMap(reinterpret_cast<internals::FileMap*>(pImpl)->update(datafile)));
+}
+FileMap FileMap::update(const std::string& datafile, const std::vector<std::pair<uint64_t, uint64_t>>& dirty_ranges) {
+	return FileMap(new internals::FileMap(reinterpret_cast<internals::FileMap*>(pImpl)->update(datafile, dirty_ranges)));
+}
+
+void FileMap::create(std::istream& datastream) {
+	reinterpret_cast<internals::FileMap*>(pImpl)->create(datastream);
+}
+void FileMap::create(const ReadCallback& read) {
+	reinterpret_cast<internals::FileMap*>(pImpl)->create(read);
+}
+FileMap FileMap::update(std::istream& datastream) {
+	return FileMap(new internals::FileMap(reinterpret_cast<internals::FileMap*>(pImpl)->update(datastream)));
+}
+FileMap FileMap::update(const ReadCallback& read) {
+	return FileMap(new internals::FileMap(reinterpret_cast<internals::FileMap*>(pImpl)->update(read)));
+}
+
+unsigned FileMap::concurrency() const {
+	return reinterpret_cast<internals::FileMap*>(pImpl)->concurrency();
+}
+void FileMap::set_concurrency(unsigned new_concurrency) {
+	reinterpret_cast<internals::FileMap*>(pImpl)->set_concurrency(new_concurrency);
+}
+uint64_t FileMap::inflight_data_limit() const {
+	return reinterpret_cast<internals::FileMap*>(pImpl)->inflight_data_limit();
+}
+void FileMap::set_inflight_data_limit(uint64_t new_inflight_data_limit) {
+	reinterpret_cast<internals::FileMap*>(pImpl)->set_inflight_data_limit(new_inflight_data_limit);
+}
+void FileMap::set_block_index(const BlockIndex& index) {
+	reinterpret_cast<internals::FileMap*>(pImpl)->set_block_index(*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(index.pImpl));
+}
+void FileMap::reset_block_index() {
+	reinterpret_cast<internals::FileMap*>(pImpl)->set_block_index(nullptr);
+}
+
+/* BlockIndex */
+BlockIndex::BlockIndex(const FileMap& prototype) {
+	pImpl = new std::shared_ptr<internals::BlockIndex>(std::make_shared<internals::BlockIndex>(*reinterpret_cast<internals::FileMap*>(prototype.pImpl)));
+}
+BlockIndex::BlockIndex(const BlockIndex& index) {
+	pImpl = new std::shared_ptr<internals::BlockIndex>(*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(index.pImpl));
+}
+BlockIndex& BlockIndex::operator=(const BlockIndex& index) {
+	*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl) = *reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(index.pImpl);
+	return *this;
+}
+BlockIndex::~BlockIndex() {
+	delete reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl);
+}
+
+void BlockIndex::add(const FileMap& map) {
+	(*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl))->add(*reinterpret_cast<internals::FileMap*>(map.pImpl));
+}
+uint64_t BlockIndex::size() const {
+	return (*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl))->size();
+}
+
+std::vector<uint8_t> BlockIndex::serialize() const {
+	return (*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl))->serialize();
+}
+void BlockIndex::deserialize(const std::vector<uint8_t>& serialized) {
+	(*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl))->deserialize(serialized.data(), serialized.size());
+}
+void BlockIndex::save(const std::string& path) const {
+	(*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl))->save(path);
+}
+void BlockIndex::load(const std::string& path) {
+	(*reinterpret_cast<std::shared_ptr<internals::BlockIndex>*>(pImpl))->load(path);
+}
+
+/* BatchSigner */
+BatchSigner::BatchSigner(const FileMap& prototype) {
+	pImpl = new internals::BatchSigner(*reinterpret_cast<internals::FileMap*>(prototype.pImpl));
+}
+BatchSigner::~BatchSigner() {
+	delete reinterpret_cast<internals::BatchSigner*>(pImpl);
+}
+
+std::vector<FileMap> BatchSigner::create(const std::vector<std::string>& paths) {
+	std::vector<FileMap> maps; maps.reserve(paths.size());
+	for(auto& map : reinterpret_cast<internals::BatchSigner*>(pImpl)->create(paths))
+		maps.push_back(FileMap(new internals::FileMap(std::move(map))));
+	return maps;
+}
+std::vector<FileMap> BatchSigner::update(const std::vector<FileMap>& old_maps, const std::vector<std::string>& paths) {
+	std::vector<const internals::FileMap*> old_internals; old_internals.reserve(old_maps.size());
+	for(auto& old_map : old_maps)
+		old_internals.push_back(reinterpret_cast<internals::FileMap*>(old_map.pImpl));
+
+	std::vector<FileMap> maps; maps.reserve(paths.size());
+	for(auto& map : reinterpret_cast<internals::BatchSigner*>(pImpl)->update(old_internals, paths))
+		maps.push_back(FileMap(new internals::FileMap(std::move(map))));
+	return maps;
+}
+
+std::map<std::string, FileMap> BatchSigner::create_directory(const std::string& directory) {
+	auto paths = internals::BatchSigner::list_directory(directory);
+	auto maps = create(paths);
+
+	std::map<std::string, FileMap> path_maps;
+	for(size_t i = 0; i < paths.size(); i++)
+		path_maps.emplace_hint(path_maps.end(), std::move(paths[i]), std::move(maps[i]));
+	return path_maps;
+}
+
+unsigned BatchSigner::concurrency() const {
+	return reinterpret_cast<internals::BatchSigner*>(pImpl)->concurrency();
+}
+void BatchSigner::set_concurrency(unsigned new_concurrency) {
+	reinterpret_cast<internals::BatchSigner*>(pImpl)->set_concurrency(new_concurrency);
 }
 
 } /* namespace librevault */
@@ -0,0 +1,88 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "BatchSigner.h"
+
+namespace cryptodiff {
+namespace internals {
+
+BatchSigner::BatchSigner(const FileMap& prototype) :
+	prototype_(prototype.make_update_map()), prototype_concurrency_(prototype.concurrency()), concurrency_(prototype.concurrency()) {
+	prototype_.set_concurrency(1);	// Tasks of the pool must not wait for other tasks of the same pool
+}
+
+std::vector<FileMap> BatchSigner::create(const std::vector<std::string>& paths) {
+	return run(paths.size(), [this, &paths](size_t i){
+		FileMap map = prototype_.make_update_map();
+		map.create(paths[i]);
+		map.set_concurrency(prototype_concurrency_);
+		return map;
+	});
+}
+
+std::vector<FileMap> BatchSigner::update(const std::vector<const FileMap*>& old_maps, const std::vector<std::string>& paths) {
+	if(old_maps.size() != paths.size()) throw error("Number of maps doesn't match number of paths");
+	return run(paths.size(), [this, &old_maps, &paths](size_t i){
+		FileMap old_map(*old_maps[i]);	// Cheap, blocks are shared
+		old_map.set_concurrency(1);
+		old_map.share_inflight_data_limit(prototype_);	// If prototype has a limit, all files of the batch stay within it
+		FileMap new_map = old_map.update(paths[i]);
+		new_map.set_concurrency(old_maps[i]->concurrency());
+		return new_map;
+	});
+}
+
+void BatchSigner::set_concurrency(unsigned new_concurrency) {
+	concurrency_ = std::max(new_concurrency, 1u);
+}
+
+std::vector<std::string> BatchSigner::list_directory(const std::string& path) {
+	std::vector<std::string> paths;
+	for(boost::filesystem::recursive_directory_iterator it(path), end; it != end; ++it){
+		if(boost::filesystem::is_regular_file(it->status()))
+			paths.push_back(it->path().string());
+	}
+	std::sort(paths.begin(), paths.end());
+	return paths;
+}
+
+template<class Function>
+std::vector<FileMap> BatchSigner::run(size_t count, Function process_file) {
+	if(!pool_ || pool_->size() != concurrency_)
+		pool_ = std::make_shared<ThreadPool>(concurrency_);
+
+	std::vector<FileMap> maps; maps.reserve(count);
+	std::deque<std::future<FileMap>> inflight;
+	auto pop = [&]{
+		maps.push_back(inflight.front().get());	// Rethrows exceptions from workers
+		inflight.pop_front();
+	};
+
+	try {
+		for(size_t i = 0; i < count; i++){
+			while(inflight.size() >= 2*concurrency_) pop();
+			inflight.push_back(pool_->post([&process_file, i]{return process_file(i);}));
+		}
+		while(!inflight.empty()) pop();
+	}catch(...){
+		for(auto& future : inflight)
+			if(future.valid()) future.wait();	// Tasks reference process_file
+		throw;
+	}
+	return maps;
+}
+
+} /* namespace internals */
+} /* namespace cryptodiff */
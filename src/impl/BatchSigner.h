@@ -0,0 +1,57 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "FileMap.h"
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Creates and updates maps of many files on one worker pool. Files are processed concurrently, each one serially on a
+ * single worker, so there is no per-file pool setup and reading of one file overlaps with signing of others. At most
+ * 2*concurrency() files are in flight at once, which bounds memory use.
+ *
+ * A single large file gets no parallelism, as it is signed by one worker. Such files are better passed to
+ * FileMap::create() or FileMap::update() directly.
+ *
+ * Maps are processed with concurrency 1, as tasks of the pool must not wait for other tasks of it. Returned maps get
+ * back the concurrency of prototype (create) or of the old map (update).
+ */
+class BatchSigner {
+public:
+	BatchSigner(const FileMap& prototype);
+
+	std::vector<FileMap> create(const std::vector<std::string>& paths);
+	std::vector<FileMap> update(const std::vector<const FileMap*>& old_maps, const std::vector<std::string>& paths);
+
+	unsigned concurrency() const {return concurrency_;}
+	void set_concurrency(unsigned new_concurrency);
+
+	// Regular files under path, recursively, in sorted order
+	static std::vector<std::string> list_directory(const std::string& path);
+
+private:
+	FileMap prototype_;	// Empty map, giving key and parameters to new maps
+	unsigned prototype_concurrency_;	// Of new maps. prototype_ itself has concurrency 1.
+	unsigned concurrency_;
+	std::shared_ptr<ThreadPool> pool_;
+
+	template<class Function>
+	std::vector<FileMap> run(size_t count, Function process_file);
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
@@ -0,0 +1,90 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "BlockIndex.h"
+#include "EncFileMapView.h"
+
+namespace cryptodiff {
+namespace internals {
+
+BlockIndex::BlockIndex(const FileMap& prototype) : FileMap(prototype.make_update_map()) {
+	block_index_.reset();
+	hashed_blocks();	// Lookups never build it, as they only take a shared lock
+}
+
+void BlockIndex::add(const FileMap& map) {
+	if(!compatible(map)) throw error("Map has different key or hash types than block index");
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+
+	// Blocks are added to the existing index. It is copied first only if a copy of this map still shares it.
+	hashed_blocks();
+	auto blockset = hashed_blocks_.use_count() == 1 ? std::const_pointer_cast<weakhash_index>(hashed_blocks_) : std::make_shared<weakhash_index>(*hashed_blocks_);
+
+	auto& offset_blocks = offset_blocks_.write();
+	for(auto& offset_block : *map.offset_blocks_){
+		const std::shared_ptr<DecryptedBlock>& block = offset_block.second;
+		auto same_block = [&](size_t n){
+			return (*blockset)[n]->enc_block_.blocksize_ == block->enc_block_.blocksize_ && (*blockset)[n]->strong_hash_ == block->strong_hash_;
+		};
+		if(blockset->find_if(block->weak_hash_, same_block) != blockset->npos) continue;	// Also blocks, that occur in map more than once
+
+		blockset->insert(block->weak_hash_, block);
+		offset_blocks.insert(offset_blocks.end(), {size_, block});
+		size_ += block->enc_block_.blocksize_;
+	}
+	hashed_blocks_ = std::move(blockset);
+}
+
+std::shared_ptr<DecryptedBlock> BlockIndex::find(weakhash_t weak_hash, const uint8_t* data, uint32_t size) {
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+
+	const weakhash_index& blockset = *hashed_blocks_;	// Always up to date, see add()
+	size_t matched = match_block(weak_hash, data, size, blockset);
+	return matched != blockset.npos ? blockset[matched] : nullptr;
+}
+
+bool BlockIndex::compatible(const FileMap& map) const {
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+	return map.key_ == key_ && map.weak_hash_type_ == weak_hash_type_ && map.strong_hash_type_ == strong_hash_type_;
+}
+
+size_t BlockIndex::size() const {
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+	return offset_blocks_->size();
+}
+
+blob BlockIndex::serialize() const {
+	std::shared_lock<std::shared_timed_mutex> lock(mutex_);
+	return FileMap::serialize();
+}
+
+void BlockIndex::set_blocks(const std::vector<Block>& new_blocks) {
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+	FileMap::set_blocks(new_blocks);
+	hashed_blocks();
+}
+
+void BlockIndex::deserialize(const uint8_t* data, size_t size) {
+	std::unique_lock<std::shared_timed_mutex> lock(mutex_);
+
+	EncFileMapView view(data, size);
+	if(view.header().weak_hash_type != weak_hash_type_ || view.header().strong_hash_type != strong_hash_type_)
+		throw error("Signature has different hash types than block index");
+	FileMap::deserialize(data, size);
+	hashed_blocks();
+}
+
+} /* namespace internals */
+} /* namespace cryptodiff */
@@ -0,0 +1,55 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "FileMap.h"
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Distinct blocks of many maps, with the same key and hash types. Maps, that use this index, take blocks with the same
+ * contents from it instead of signing them again, so identical data in different files produces identical blocks.
+ *
+ * The index is stored as a map, whose blocks are laid end to end, so it is saved and loaded in the signature format.
+ * Lookups may run concurrently, modifications take an exclusive lock.
+ */
+class BlockIndex : public FileMap {
+public:
+	BlockIndex(const FileMap& prototype);
+
+	// Adds blocks of map, which are not in the index yet.
+	void add(const FileMap& map);
+
+	// Block with the same weak hash, size and contents as data, or nullptr.
+	std::shared_ptr<DecryptedBlock> find(weakhash_t weak_hash, const uint8_t* data, uint32_t size);
+
+	// Whether blocks of the index can be used by map: key and hash types must be the same.
+	bool compatible(const FileMap& map) const;
+
+	size_t size() const;
+
+	// Same as in EncFileMap, but synchronized with add()
+	blob serialize() const;
+	void set_blocks(const std::vector<Block>& new_blocks);
+	// Throws, if the signature has other hash types than the index. The index is left unchanged then.
+	void deserialize(const uint8_t* data, size_t size);
+
+private:
+	mutable std::shared_timed_mutex mutex_;
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
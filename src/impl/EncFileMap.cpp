@@ -14,54 +14,119 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "EncFileMap.h"
+#include "EncFileMapView.h"
+#include <boost/iostreams/device/mapped_file.hpp>
 
 namespace cryptodiff {
 namespace internals {
 
 std::shared_ptr<spdlog::logger> logger = std::shared_ptr<spdlog::logger>();
 
-void DecryptedBlock::encrypt_hashes(const blob& key){
-	struct Hashes {
-		uint32_t weak_hash;
-		std::array<uint8_t, 28> strong_hash;
-	} temp_hashes;
-	temp_hashes.weak_hash = boost::endian::native_to_big(weak_hash_);
-	std::copy(strong_hash_.begin(), strong_hash_.begin()+std::min(strong_hash_.size(), (size_t)28), temp_hashes.strong_hash.begin());
+BlockRecord::BlockRecord(const Block& block) {
+	if(block.encrypted_data_hash_.size() != encrypted_data_hash_.size()) throw error("Block has unsupported encrypted data hash size");
+	if(block.iv_.size() != iv_.size()) throw error("Block has unsupported IV size");
 
-	enc_block_.encrypted_rsync_hashes_ = blob((uint8_t*)&temp_hashes, (uint8_t*)&temp_hashes+sizeof(Hashes)) |
-			crypto::AES_CBC(key, enc_block_.iv_, false);
+	std::copy(block.encrypted_data_hash_.begin(), block.encrypted_data_hash_.end(), encrypted_data_hash_.begin());
+	set_encrypted_rsync_hashes(block.encrypted_rsync_hashes_.data(), block.encrypted_rsync_hashes_.size());
+	blocksize_ = block.blocksize_;
+	std::copy(block.iv_.begin(), block.iv_.end(), iv_.begin());
 }
 
-void DecryptedBlock::decrypt_hashes(const blob& key){
-	auto decrypted_vector = enc_block_.encrypted_rsync_hashes_ | crypto::De<crypto::AES_CBC>(key, enc_block_.iv_, false);
+BlockRecord::operator Block() const {
+	Block block;
+	block.encrypted_data_hash_.assign(encrypted_data_hash_.begin(), encrypted_data_hash_.end());
+	block.encrypted_rsync_hashes_ = encrypted_rsync_hashes();
+	block.blocksize_ = blocksize_;
+	block.iv_.assign(iv_.begin(), iv_.end());
+	return block;
+}
+
+void BlockRecord::set_encrypted_rsync_hashes(const uint8_t* data, size_t size) {
+	if(size > encrypted_rsync_hashes_.size()) throw error("Block has unsupported encrypted hashes size");
+	std::copy(data, data+size, encrypted_rsync_hashes_.begin());
+	encrypted_rsync_hashes_size_ = (uint8_t)size;
+}
+
+size_t DecryptedBlock::weak_hash_size(WeakHashType weak_hash_type) {
+	switch(weak_hash_type){
+		case RSYNC: return sizeof(weakhash32_t);
+		case RSYNC64: return sizeof(weakhash64_t);
+		default: throw error("Unknown weak hash type");
+	}
+}
+
+size_t DecryptedBlock::rsync_hashes_size(WeakHashType weak_hash_type) {
+	// Weak hash, then 28 bytes of strong hash, zero-padded to AES block size: 32 bytes for RSYNC, 48 bytes for RSYNC64.
+	return (weak_hash_size(weak_hash_type) + 28 + 15) / 16 * 16;
+}
+
+void DecryptedBlock::encrypt_hashes(const blob& key, WeakHashType weak_hash_type){
+	CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption cipher;
+	cipher.SetKeyWithIV(key.data(), key.size(), enc_block_.iv_.data(), enc_block_.iv_.size());
+	encrypt_hashes(cipher, weak_hash_type);
+}
+
+void DecryptedBlock::encrypt_hashes(CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption& cipher, WeakHashType weak_hash_type){
+	std::array<uint8_t, 48> temp_hashes = {};	// Hashes are padded with zeroes to a multiple of AES block size
+	auto rsync_hashes_size = DecryptedBlock::rsync_hashes_size(weak_hash_type);
+	auto weak_hash_size = DecryptedBlock::weak_hash_size(weak_hash_type);
 
-	struct Hashes {
-		uint32_t weak_hash;
-		std::array<uint8_t, 28> strong_hash;
-	} temp_hashes;
-	std::move(decrypted_vector.begin(), decrypted_vector.end(), (uint8_t*)&temp_hashes);
+	if(weak_hash_type == RSYNC64){
+		weakhash64_t weak_hash_be = boost::endian::native_to_big((weakhash64_t)weak_hash_);
+		std::copy((uint8_t*)&weak_hash_be, (uint8_t*)&weak_hash_be+weak_hash_size, temp_hashes.begin());
+	}else{
+		weakhash32_t weak_hash_be = boost::endian::native_to_big((weakhash32_t)weak_hash_);
+		std::copy((uint8_t*)&weak_hash_be, (uint8_t*)&weak_hash_be+weak_hash_size, temp_hashes.begin());
+	}
+	std::copy(strong_hash_.begin(), strong_hash_.begin()+std::min(strong_hash_.size(), (size_t)28), temp_hashes.begin()+weak_hash_size);
+
+	std::array<uint8_t, 48> encrypted_hashes;
+	cipher.ProcessData(encrypted_hashes.data(), temp_hashes.data(), rsync_hashes_size);
+	enc_block_.set_encrypted_rsync_hashes(encrypted_hashes.data(), rsync_hashes_size);
+}
 
-	weak_hash_ = boost::endian::big_to_native(temp_hashes.weak_hash);
-	strong_hash_.resize(temp_hashes.strong_hash.size());
-	std::copy(temp_hashes.strong_hash.begin(), temp_hashes.strong_hash.end(), strong_hash_.begin());
+void DecryptedBlock::decrypt_hashes(const blob& key, WeakHashType weak_hash_type){
+	CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption cipher;
+	cipher.SetKeyWithIV(key.data(), key.size(), enc_block_.iv_.data(), enc_block_.iv_.size());
+	decrypt_hashes(cipher, weak_hash_type);
+}
+
+void DecryptedBlock::decrypt_hashes(CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption& cipher, WeakHashType weak_hash_type){
+	auto weak_hash_size = DecryptedBlock::weak_hash_size(weak_hash_type);
+	auto rsync_hashes_size = DecryptedBlock::rsync_hashes_size(weak_hash_type);
+	if(enc_block_.encrypted_rsync_hashes_size_ != rsync_hashes_size) throw error("Encrypted hashes size doesn't match weak hash type");
+
+	std::array<uint8_t, 48> decrypted_vector;
+	cipher.ProcessData(decrypted_vector.data(), enc_block_.encrypted_rsync_hashes_.data(), rsync_hashes_size);
+
+	if(weak_hash_type == RSYNC64){
+		weakhash64_t weak_hash_be;
+		std::copy(decrypted_vector.begin(), decrypted_vector.begin()+weak_hash_size, (uint8_t*)&weak_hash_be);
+		weak_hash_ = boost::endian::big_to_native(weak_hash_be);
+	}else{
+		weakhash32_t weak_hash_be;
+		std::copy(decrypted_vector.begin(), decrypted_vector.begin()+weak_hash_size, (uint8_t*)&weak_hash_be);
+		weak_hash_ = boost::endian::big_to_native(weak_hash_be);
+	}
+	std::copy_n(decrypted_vector.begin()+weak_hash_size, strong_hash_.size(), strong_hash_.begin());
 }
 
 std::string DecryptedBlock::debug_string() const {
 	std::ostringstream debug_string_os;
 
 	// Found in encrypted
-	auto encrypted_data_hash_hex = enc_block_.encrypted_data_hash_ | crypto::Hex();
-	auto iv_hex = enc_block_.iv_ | crypto::Hex();
-	auto encrypted_rsync_hashes_hex = enc_block_.encrypted_rsync_hashes_ | crypto::Hex();
+	auto encrypted_data_hash_hex = blob(enc_block_.encrypted_data_hash_.begin(), enc_block_.encrypted_data_hash_.end()) | crypto::Hex();
+	auto iv_hex = enc_block_.iv() | crypto::Hex();
+	auto encrypted_rsync_hashes_hex = enc_block_.encrypted_rsync_hashes() | crypto::Hex();
 
 	debug_string_os << " Size=" << enc_block_.blocksize_
 					<< " Hash(data)=" << std::string(std::make_move_iterator(encrypted_data_hash_hex.begin()), std::make_move_iterator(encrypted_data_hash_hex.end()))
 					<< " IV=" << std::string(std::make_move_iterator(iv_hex.begin()), std::make_move_iterator(iv_hex.end()))
 					<< " AES(Rsync(Block))=" << std::string(std::make_move_iterator(encrypted_rsync_hashes_hex.begin()), std::make_move_iterator(encrypted_rsync_hashes_hex.end()));
-	if(strong_hash_.empty()){
+	if(strong_hash_ != strong_hash_t()){
 		// Found in unencrypted
 		std::ostringstream hex_checksum; hex_checksum << "0x" << std::hex << std::setfill('0') << std::setw(8) << weak_hash_;
-		auto strong_hash_hex = strong_hash_ | crypto::Hex();
+		auto strong_hash_hex = blob(strong_hash_.begin(), strong_hash_.end()) | crypto::Hex();
 
 		debug_string_os << " Rsync(DecryptedBlock)=" << hex_checksum.str()
 						<< " Hash(DecryptedBlock)=" << std::string(std::make_move_iterator(strong_hash_hex.begin()), std::make_move_iterator(strong_hash_hex.end()));
@@ -74,36 +139,43 @@ EncFileMap::~EncFileMap() {}
 
 std::vector<Block> EncFileMap::blocks() const {
 	std::vector<Block> blist;
-	for(auto block : offset_blocks_){
+	for(auto block : *offset_blocks_){
 		blist.push_back(block.second->enc_block_);
 	}
 	return blist;
 }
 
-std::vector<Block> EncFileMap::delta(const EncFileMap& old_filemap){
-	auto strong_hash_less = [](const decltype(offset_blocks_ | boost::adaptors::map_values)::value_type &block1, const decltype(offset_blocks_ | boost::adaptors::map_values)::value_type &block2){
-		return block1->enc_block_.encrypted_data_hash_ < block2->enc_block_.encrypted_data_hash_;
+std::vector<Block> EncFileMap::delta(const EncFileMap& old_filemap) const {
+	// Index of encrypted data hashes, keyed by their first 8 bytes. Hashes are uniform, so it is a good enough key.
+	auto hash_key = [](const strong_hash_t& hash){
+		uint64_t key; std::copy_n(hash.begin(), sizeof(key), (uint8_t*)&key);
+		return key;
 	};
+	WeakHashIndex<const DecryptedBlock*> known_blocks;
+	known_blocks.reserve(old_filemap.offset_blocks_->size());
+	for(auto& offset_block : *old_filemap.offset_blocks_)
+		known_blocks.insert(hash_key(offset_block.second->enc_block_.encrypted_data_hash_), offset_block.second.get());
 
-	std::list<std::shared_ptr<const DecryptedBlock>> missing_blocks;
-	std::set_difference(
-			(offset_blocks_ | boost::adaptors::map_values).begin(),
-			(offset_blocks_ | boost::adaptors::map_values).end(),
-			(old_filemap.offset_blocks_ | boost::adaptors::map_values).begin(),
-			(old_filemap.offset_blocks_ | boost::adaptors::map_values).end(),
-			std::back_inserter(missing_blocks), strong_hash_less);
+	std::vector<Block> missing_blocks;
+	for(auto& offset_block : *offset_blocks_){
+		const DecryptedBlock* block = offset_block.second.get();
+		auto key = hash_key(block->enc_block_.encrypted_data_hash_);
 
-	std::vector<Block> blist;
-	for(auto block_ptr : missing_blocks){
-		blist.push_back(block_ptr->enc_block_);
+		bool known = known_blocks.find_if(key, [&](size_t n){
+			return known_blocks[n]->enc_block_.encrypted_data_hash_ == block->enc_block_.encrypted_data_hash_;
+		}) != known_blocks.npos;
+		if(!known){
+			missing_blocks.push_back(block->enc_block_);
+			known_blocks.insert(key, block);	// Block, that occurs multiple times in this map, is needed only once
+		}
 	}
-	return blist;
+	return missing_blocks;
 }
 
 std::string EncFileMap::debug_string() const {
 	std::ostringstream os;
 	int i = 0;
-	for(auto block : offset_blocks_){
+	for(auto block : *offset_blocks_){
 		os << "N=" << ++i << " " <<  block.second->debug_string();
 		print_debug_block(*(block.second), ++i);
 	}
@@ -116,14 +188,97 @@ void EncFileMap::print_debug_block(const DecryptedBlock& block, int num) const {
 	}
 }
 
+blob EncFileMap::serialize() const {
+	EncFileMapView::Header header;
+	header.strong_hash_type = strong_hash_type_;
+	header.weak_hash_type = weak_hash_type_;
+	header.chunking_type = chunking_type_;
+	header.maxblocksize = maxblocksize_;
+	header.minblocksize = minblocksize_;
+	header.block_count = offset_blocks_->size();
+	header.filesize = size_;
+
+	const size_t rsync_hashes_size = EncFileMapView::rsync_hashes_size(weak_hash_type_);
+	const size_t record_size = EncFileMapView::record_size(weak_hash_type_);
+
+	blob serialized(EncFileMapView::header_size + offset_blocks_->size()*record_size);
+	EncFileMapView::write_header(header, serialized.data());
+
+	uint8_t* record = serialized.data()+EncFileMapView::header_size;
+	for(auto& block : *offset_blocks_){
+		const BlockRecord& enc_block = block.second->enc_block_;
+		if(enc_block.encrypted_rsync_hashes_size_ != rsync_hashes_size) throw error("Block can't be serialized: unexpected encrypted hashes size");
+
+		record = std::copy(enc_block.encrypted_data_hash_.begin(), enc_block.encrypted_data_hash_.end(), record);
+		record = std::copy_n(enc_block.encrypted_rsync_hashes_.begin(), rsync_hashes_size, record);
+		EncFileMapView::store_u32(enc_block.blocksize_, record); record += 4;
+		record = std::copy(enc_block.iv_.begin(), enc_block.iv_.end(), record);
+	}
+	return serialized;
+}
+
+void EncFileMap::deserialize(const uint8_t* data, size_t size) {
+	EncFileMapView view(data, size);
+
+	// Blocks are parsed aside, so the map stays as it was, if the signature is rejected
+	std::map<offset_t, std::shared_ptr<DecryptedBlock>> offset_blocks;
+	offset_t filesize = 0;
+	for(size_t i = 0; i < view.size(); i++){
+		auto record = view[i];
+
+		auto new_block = std::make_shared<DecryptedBlock>();
+		std::copy_n(record.encrypted_data_hash(), EncFileMapView::data_hash_size, new_block->enc_block_.encrypted_data_hash_.begin());
+		new_block->enc_block_.set_encrypted_rsync_hashes(record.encrypted_rsync_hashes(), record.encrypted_rsync_hashes_size());
+		new_block->enc_block_.blocksize_ = record.blocksize();
+		std::copy_n(record.iv(), EncFileMapView::iv_size, new_block->enc_block_.iv_.begin());
+
+		offset_blocks.insert(offset_blocks.end(), std::make_pair(filesize, std::move(new_block)));
+		filesize += record.blocksize();
+	}
+	if(filesize != view.header().filesize) throw error("Signature is inconsistent: block sizes don't sum up to file size");
+
+	strong_hash_type_ = view.header().strong_hash_type;
+	weak_hash_type_ = view.header().weak_hash_type;
+	chunking_type_ = view.header().chunking_type;
+	maxblocksize_ = view.header().maxblocksize;
+	minblocksize_ = view.header().minblocksize;
+
+	size_ = filesize;
+	offset_blocks_.reset() = std::move(offset_blocks);
+}
+
+void EncFileMap::set_weak_hash_type(WeakHashType new_weak_hash_type) {
+	if(!offset_blocks_->empty() && DecryptedBlock::rsync_hashes_size(new_weak_hash_type) != offset_blocks_->begin()->second->enc_block_.encrypted_rsync_hashes_size_)
+		throw error("Weak hash type doesn't match encrypted hashes of blocks in map");
+	weak_hash_type_ = new_weak_hash_type;
+}
+
+void EncFileMap::save(const std::string& path) const {
+	blob serialized = serialize();
+	std::ofstream ofs;
+	ofs.exceptions(std::ios::failbit | std::ios::badbit);
+	ofs.open(path, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	ofs.write(reinterpret_cast<const char*>(serialized.data()), serialized.size());
+}
+
+void EncFileMap::load(const std::string& path) {
+	boost::iostreams::mapped_file_source mapped_file(path);
+	deserialize(reinterpret_cast<const uint8_t*>(mapped_file.data()), mapped_file.size());
+}
+
 void EncFileMap::set_blocks(const std::vector<Block>& new_blocks) {
+	// Hashes are decoded according to weak_hash_type_, so it must be set before blocks
+	const size_t rsync_hashes_size = DecryptedBlock::rsync_hashes_size(weak_hash_type_);
+	for(auto& block : new_blocks)
+		if(block.encrypted_rsync_hashes_.size() != rsync_hashes_size) throw error("Encrypted hashes size of block doesn't match weak hash type of map");
+
 	size_ = 0;
-	offset_blocks_.clear();
-	for(auto block : new_blocks){
+	auto& offset_blocks = offset_blocks_.reset();
+	for(auto& block : new_blocks){
 		auto new_block = std::make_shared<DecryptedBlock>();
 		new_block->enc_block_ = block;
 
-		offset_blocks_.insert(make_pair(size_, new_block));
+		offset_blocks.insert(offset_blocks.end(), std::make_pair(size_, std::move(new_block)));
 		size_ += block.blocksize_;
 	}
 }
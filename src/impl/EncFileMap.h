@@ -17,6 +17,9 @@
 #include "pch.h"
 #include "../../include/cryptodiff.h"
 #include "crypto/RsyncChecksum.h"
+#include "crypto/StrongHasher.h"
+#include "util/CopyOnWrite.h"
+#include "util/WeakHashIndex.h"
 
 namespace cryptodiff {
 namespace internals {
@@ -24,14 +27,44 @@ namespace internals {
 extern std::shared_ptr<spdlog::logger> logger;
 inline void set_logger(std::shared_ptr<spdlog::logger> new_logger) {logger = new_logger;}
 
+using strong_hash_t = StrongHasher::hash_type;
+
+inline strong_hash_t compute_strong_hash(const uint8_t* data, size_t size, StrongHashType type) {
+	return StrongHasher::local(type).update(data, size).final();
+}
+
+/* Internal representation of Block, with inline storage instead of heap-allocated vectors */
+struct BlockRecord {
+	std::array<uint8_t, 28> encrypted_data_hash_ = {};
+	std::array<uint8_t, 48> encrypted_rsync_hashes_ = {};	// First encrypted_rsync_hashes_size_ bytes are used
+	uint8_t encrypted_rsync_hashes_size_ = 0;
+	uint32_t blocksize_ = 0;
+	std::array<uint8_t, 16> iv_ = {};
+
+	BlockRecord() {}
+	BlockRecord(const Block& block);
+	operator Block() const;
+
+	blob iv() const {return blob(iv_.begin(), iv_.end());}
+	blob encrypted_rsync_hashes() const {return blob(encrypted_rsync_hashes_.begin(), encrypted_rsync_hashes_.begin()+encrypted_rsync_hashes_size_);}
+	void set_encrypted_rsync_hashes(const uint8_t* data, size_t size);
+};
+
 struct DecryptedBlock {
-	Block enc_block_;
+	BlockRecord enc_block_;
+
+	weakhash_t weak_hash_ = 0;	// 4 bytes with RSYNC, 8 bytes with RSYNC64
+	strong_hash_t strong_hash_ = {};	// 28 bytes
 
-	weakhash_t weak_hash_ = 0;	// 4 bytes
-	blob strong_hash_ = {};	// 28 bytes
+	void encrypt_hashes(const blob& key, WeakHashType weak_hash_type);
+	// Same, with a cipher already keyed and synchronized with enc_block_.iv_
+	void encrypt_hashes(CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption& cipher, WeakHashType weak_hash_type);
+	void decrypt_hashes(const blob& key, WeakHashType weak_hash_type);
+	// Same, with a cipher already keyed and synchronized with enc_block_.iv_
+	void decrypt_hashes(CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption& cipher, WeakHashType weak_hash_type);
 
-	void encrypt_hashes(const blob& key);
-	void decrypt_hashes(const blob& key);
+	static size_t weak_hash_size(WeakHashType weak_hash_type);
+	static size_t rsync_hashes_size(WeakHashType weak_hash_type);
 
 	std::string debug_string() const;
 };
@@ -39,9 +72,17 @@ struct DecryptedBlock {
 class EncFileMap {
 public:
 	EncFileMap();
+	EncFileMap(const EncFileMap& encfilemap) = default;
+	EncFileMap(EncFileMap&& encfilemap) = default;
+	EncFileMap& operator=(const EncFileMap& encfilemap) = default;
+	EncFileMap& operator=(EncFileMap&& encfilemap) = default;
 	virtual ~EncFileMap();
 
-	std::vector<Block> delta(const EncFileMap& old_filemap);
+	// Copy of the most derived type. Cheap, as blocks are shared between copies.
+	virtual EncFileMap* clone() const {return new EncFileMap(*this);}
+
+	// Blocks of this map, which old_filemap doesn't contain, in offset order. Linear in size of both maps.
+	std::vector<Block> delta(const EncFileMap& old_filemap) const;
 
 	virtual void print_debug_block(const DecryptedBlock& block, int num = 0) const;
 
@@ -54,13 +95,21 @@ public:
 	uint32_t minblocksize() const {return minblocksize_;}
 	StrongHashType strong_hash_type() const {return strong_hash_type_;}
 	WeakHashType weak_hash_type() const {return weak_hash_type_;}
+	ChunkingType chunking_type() const {return chunking_type_;}
+
+	// Serialization
+	virtual blob serialize() const;
+	virtual void deserialize(const uint8_t* data, size_t size);
+	void save(const std::string& path) const;
+	void load(const std::string& path);
 
 	// Setters
 	virtual void set_blocks(const std::vector<Block>& new_blocks);
 	void set_maxblocksize(uint32_t new_maxblocksize) {maxblocksize_ = new_maxblocksize;}
 	void set_minblocksize(uint32_t new_minblocksize) {minblocksize_ = new_minblocksize;}
 	void set_strong_hash_type(StrongHashType new_strong_hash_type) {strong_hash_type_ = new_strong_hash_type;}
-	void set_weak_hash_type(WeakHashType new_weak_hash_type) {weak_hash_type_ = new_weak_hash_type;}
+	void set_weak_hash_type(WeakHashType new_weak_hash_type);	// Must match encrypted hashes of blocks, if there are any
+	void set_chunking_type(ChunkingType new_chunking_type) {chunking_type_ = new_chunking_type;}
 
 protected:
 	using offset_t = uint64_t;
@@ -71,9 +120,11 @@ protected:
 
 	StrongHashType strong_hash_type_ = SHA3_224;
 	WeakHashType weak_hash_type_ = RSYNC;
+	ChunkingType chunking_type_ = FIXED;
 
 	// Other data
-	std::map<offset_t, std::shared_ptr<DecryptedBlock>> offset_blocks_;
+	// Shared between copies of the map, until modified. Blocks are not modified after being inserted.
+	CopyOnWrite<std::map<offset_t, std::shared_ptr<DecryptedBlock>>> offset_blocks_;
 	offset_t size_ = 0;
 };
 
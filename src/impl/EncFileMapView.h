@@ -0,0 +1,122 @@
+/* Copyright (C) 2014-2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "EncFileMap.h"
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Binary signature format. All integers are big-endian.
+ *
+ * Header, 32 bytes:
+ *   "CDFM" | version:u8 | strong_hash_type:u8 | weak_hash_type:u8 | chunking_type:u8 |
+ *   maxblocksize:u32 | minblocksize:u32 | block_count:u64 | filesize:u64
+ * Followed by block_count fixed-width records, in offset order:
+ *   encrypted_data_hash[28] | encrypted_rsync_hashes[32 with RSYNC, 48 with RSYNC64] | blocksize:u32 | iv[16]
+ *
+ * EncFileMapView reads this format in place (e.g. from a memory-mapped file), without copying anything.
+ */
+class EncFileMapView {
+public:
+	static constexpr uint8_t version = 1;
+	static constexpr size_t header_size = 32;
+	static constexpr size_t data_hash_size = 28;
+	static constexpr size_t iv_size = 16;
+
+	struct Header {
+		StrongHashType strong_hash_type;
+		WeakHashType weak_hash_type;
+		ChunkingType chunking_type;
+		uint32_t maxblocksize;
+		uint32_t minblocksize;
+		uint64_t block_count;
+		uint64_t filesize;
+	};
+
+	class Record {
+	public:
+		Record(const uint8_t* data, size_t rsync_hashes_size) : data_(data), rsync_hashes_size_(rsync_hashes_size) {}
+
+		const uint8_t* encrypted_data_hash() const {return data_;}
+		const uint8_t* encrypted_rsync_hashes() const {return data_+data_hash_size;}
+		size_t encrypted_rsync_hashes_size() const {return rsync_hashes_size_;}
+		uint32_t blocksize() const {return load_u32(data_+data_hash_size+rsync_hashes_size_);}
+		const uint8_t* iv() const {return data_+data_hash_size+rsync_hashes_size_+4;}
+	private:
+		const uint8_t* data_;
+		size_t rsync_hashes_size_;
+	};
+
+	EncFileMapView(const uint8_t* data, size_t size) : data_(data) {
+		if(size < header_size || !std::equal(data, data+4, "CDFM")) throw error("Not a cryptodiff signature");
+		if(data[4] != version) throw error("Unsupported signature version");
+
+		header_.strong_hash_type = (StrongHashType)data[5];
+		header_.weak_hash_type = (WeakHashType)data[6];
+		header_.chunking_type = (ChunkingType)data[7];
+		header_.maxblocksize = load_u32(data+8);
+		header_.minblocksize = load_u32(data+12);
+		header_.block_count = load_u64(data+16);
+		header_.filesize = load_u64(data+24);
+
+		switch(header_.strong_hash_type){
+			case SHA3_224: case SHA2_224: case BLAKE2B_224: break;
+			default: throw error("Unknown strong hash type");
+		}
+		switch(header_.chunking_type){
+			case FIXED: case FASTCDC: break;
+			default: throw error("Unknown chunking type");
+		}
+
+		rsync_hashes_size_ = rsync_hashes_size(header_.weak_hash_type);
+		const size_t records_size = size - header_size;
+		if(records_size / record_size(header_.weak_hash_type) < header_.block_count) throw error("Signature is truncated");
+		if(records_size != header_.block_count * record_size(header_.weak_hash_type)) throw error("Signature has trailing data");
+	}
+
+	const Header& header() const {return header_;}
+	uint64_t size() const {return header_.block_count;}
+	Record operator[](size_t i) const {return Record(data_+header_size+i*record_size(header_.weak_hash_type), rsync_hashes_size_);}
+
+	static size_t rsync_hashes_size(WeakHashType weak_hash_type) {return DecryptedBlock::rsync_hashes_size(weak_hash_type);}
+	static size_t record_size(WeakHashType weak_hash_type) {return data_hash_size + rsync_hashes_size(weak_hash_type) + 4 + iv_size;}
+
+	static void write_header(const Header& header, uint8_t* dest) {
+		std::copy_n("CDFM", 4, dest);
+		dest[4] = version;
+		dest[5] = header.strong_hash_type;
+		dest[6] = header.weak_hash_type;
+		dest[7] = header.chunking_type;
+		store_u32(header.maxblocksize, dest+8);
+		store_u32(header.minblocksize, dest+12);
+		store_u64(header.block_count, dest+16);
+		store_u64(header.filesize, dest+24);
+	}
+
+	static uint32_t load_u32(const uint8_t* src) {uint32_t value; std::copy_n(src, 4, (uint8_t*)&value); return boost::endian::big_to_native(value);}
+	static uint64_t load_u64(const uint8_t* src) {uint64_t value; std::copy_n(src, 8, (uint8_t*)&value); return boost::endian::big_to_native(value);}
+	static void store_u32(uint32_t value, uint8_t* dest) {value = boost::endian::native_to_big(value); std::copy_n((const uint8_t*)&value, 4, dest);}
+	static void store_u64(uint64_t value, uint8_t* dest) {value = boost::endian::native_to_big(value); std::copy_n((const uint8_t*)&value, 8, dest);}
+
+private:
+	const uint8_t* data_;
+	Header header_;
+	size_t rsync_hashes_size_;
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
@@ -14,13 +14,80 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #include "FileMap.h"
+#include "BlockIndex.h"
 
 namespace cryptodiff {
 namespace internals {
 
-FileMap::FileMap(blob key) : EncFileMap(), key_(std::move(key)) {}
+FileMap::FileMap(blob key) : EncFileMap(), key_(std::move(key)), encryption_pool_(std::make_shared<EncryptionPool>(key_)) {}
 FileMap::~FileMap() {}
 
+/* Keeps at most max_inflight blocks being signed on the worker pool. Blocks are inserted into the map in push order. */
+class FileMap::BlockQueue {
+public:
+	BlockQueue(FileMap& map, const weakhash_index* reused_blocks = nullptr) :
+		map_(map), reused_blocks_(reused_blocks), max_inflight_(map.max_inflight_blocks()) {
+		if(map_.concurrency_ > 1) map_.worker_pool();
+	}
+	~BlockQueue() {
+		for(auto& block : inflight_) block.second.wait();	// Tasks reference the map, so they must not outlive the queue
+	}
+
+	void push(offset_t offset, BufferPool::Buffer data) {
+		if(map_.concurrency_ <= 1) {
+			map_.insert_block(offset, map_.create_block(*data, offset, num_++, reused_blocks_));
+			return;
+		}
+
+		while(inflight_.size() >= max_inflight_) pop();
+
+		int num = num_++;
+		inflight_.emplace_back(offset, map_.pool_->post([this, offset, num, data = std::move(data)]() mutable {
+			auto block = map_.create_block(*data, offset, num, reused_blocks_);
+			data.release();	// Back to the budget as soon as possible, not when the task is destroyed
+			return block;
+		}));
+	}
+
+	void finish() {
+		while(!inflight_.empty()) pop();
+	}
+
+private:
+	FileMap& map_;
+	const weakhash_index* reused_blocks_;
+	const size_t max_inflight_;
+	int num_ = 0;
+
+	std::deque<std::pair<offset_t, std::future<std::shared_ptr<DecryptedBlock>>>> inflight_;
+
+	void pop() {
+		auto block = inflight_.front().second.get();	// Rethrows exceptions from workers
+		map_.insert_block(inflight_.front().first, std::move(block));
+		inflight_.pop_front();
+	}
+};
+
+namespace {
+
+// Reads until size bytes are read or the stream ends.
+size_t read_full(const ReadCallback& read, uint8_t* buffer, size_t size) {
+	size_t bytes_read = 0, last_read;
+	while(bytes_read < size && (last_read = read(buffer+bytes_read, size-bytes_read)) != 0)
+		bytes_read += last_read;
+	return bytes_read;
+}
+
+ReadCallback istream_callback(std::istream& datastream) {
+	return [&datastream](uint8_t* buffer, size_t size) -> size_t {
+		datastream.read(reinterpret_cast<char*>(buffer), size);
+		if(datastream.bad()) throw error("Error reading from input stream");
+		return (size_t)datastream.gcount();
+	};
+}
+
+} /* namespace */
+
 void FileMap::create(const std::string& path) {
 	File datafile(path);
 	size_ = datafile.size();
@@ -28,19 +95,189 @@ void FileMap::create(const std::string& path) {
 	fill_with_map(datafile, {0, size_});
 }
 
-FileMap FileMap::update(const std::string& path) {
+void FileMap::create(std::istream& datastream) {
+	create(istream_callback(datastream));
+}
+
+void FileMap::create(const ReadCallback& read) {
+	size_ = 0;
+	fill_with_stream(read);
+}
+
+void FileMap::fill_with_stream(const ReadCallback& read, const weakhash_index* reused_blocks) {
 	if(maxblocksize_ == 0) throw error("Maximum block size must be > 0");
+	FastCDC chunker(minblocksize_, maxblocksize_);
+	BlockQueue queue(*this, reused_blocks);
+
+	// Holds at least one maximum-sized block ahead, unless the stream ends earlier.
+	BufferPool::Reservation reservation(buffer_pool_.get(), (size_t)maxblocksize_+File::sequential_read_size);
+	blob buffer; size_t buffer_pos = 0;
+	bool eof = false;
+	for(;;){
+		if(buffer.size()-buffer_pos < maxblocksize_ && !eof){
+			buffer.erase(buffer.begin(), buffer.begin()+buffer_pos); buffer_pos = 0;
+			size_t old_size = buffer.size();
+			buffer.resize(old_size + File::sequential_read_size);
+			buffer.resize(old_size + read_full(read, buffer.data()+old_size, File::sequential_read_size));
+			eof = buffer.size() - old_size < File::sequential_read_size;
+		}
+		if(buffer_pos == buffer.size()) break;
 
-	File datafile(path);
+		size_t bytes_left = buffer.size()-buffer_pos;
+		uint32_t chunk_size = chunking_type_ == FASTCDC ? chunker.cut(buffer.data()+buffer_pos, bytes_left) : (uint32_t)std::min(bytes_left, (size_t)maxblocksize_);
+
+		BufferPool::Buffer block_data = acquire_buffer(chunk_size);
+		std::copy(buffer.begin()+buffer_pos, buffer.begin()+buffer_pos+chunk_size, block_data->begin());
+		queue.push(size_, std::move(block_data));
+		buffer_pos += chunk_size;
+		size_ += chunk_size;
+	}
+
+	queue.finish();
+}
+
+template<class ChecksumT>
+void FileMap::scan_blocks(File& datafile, block_type space, offset_t data_end, const weakhash_index& blockset, const std::vector<uint32_t>& sizes, std::vector<bool>& consumed, std::vector<block_match>& matches) {
+	const uint32_t largest_size = sizes.empty() ? 0 : *std::max_element(sizes.begin(), sizes.end());
+	const offset_t end_offset = space.first+space.second;
+
+	// Sliding buffer, holding at least one largest window ahead, unless data ends earlier. It grows to less than
+	// largest_size plus one read, and prefix sums take 8 bytes for each of its bytes.
+	BufferPool::Reservation reservation(buffer_pool_.get(), 9*((size_t)largest_size+File::sequential_read_size));
+	blob buffer; RsyncPrefixSums sums;
+	offset_t buffer_offset = space.first, read_offset = space.first;
+
+	for(offset_t current_offset = space.first; current_offset < end_offset; ){
+		size_t pos = size_t(current_offset-buffer_offset);
+		if(buffer.size()-pos < largest_size && read_offset < data_end){
+			buffer.erase(buffer.begin(), buffer.begin()+pos); sums.discard(pos);
+			buffer_offset = current_offset; pos = 0;
+			while(buffer.size() < largest_size && read_offset < data_end){
+				auto bytes_to_read = (size_t)std::min<offset_t>(data_end-read_offset, File::sequential_read_size);
+				buffer.resize(buffer.size()+bytes_to_read);
+				datafile.read(read_offset, (uint32_t)bytes_to_read, buffer.data()+buffer.size()-bytes_to_read);
+				sums.append(buffer.data()+buffer.size()-bytes_to_read, bytes_to_read);
+				read_offset += bytes_to_read;
+			}
+		}
+
+		// Windows of all sizes start here. First match in order of preference wins. Unlike rolling every size over the
+		// whole file in turn, a smaller block matched here shadows a preferred one, that starts inside of it. Blocks of
+		// one map don't overlap, so this only happens with moved or repeated data, and the file is covered either way.
+		size_t matched = weakhash_index::npos; uint32_t matched_size = 0;
+		for(auto size : sizes){
+			if(size == 0 || size > buffer.size()-pos) continue;
+
+			uint32_t raw_s1, raw_s2;
+			sums.window_sums(pos, size, raw_s1, raw_s2);
+			weakhash_t weak_hash = ChecksumT().assign(raw_s1, raw_s2, size);
+
+			matched = match_block(weak_hash, buffer.data()+pos, size, blockset, &consumed);
+			if(matched != weakhash_index::npos){
+				log_matched(weak_hash, size);
+				matched_size = size;
+				break;
+			}
+		}
+
+		if(matched != weakhash_index::npos){
+			consumed[matched] = true;
+			matches.push_back({current_offset, matched});
+			current_offset += matched_size;
+		}else
+			current_offset++;
+	}
+}
+
+template<class ChecksumT>
+std::vector<FileMap::block_match> FileMap::match_file(File& datafile, const weakhash_index& blockset, std::vector<bool>& consumed) {
+	// Fixed, so the segment layout and therefore the result don't depend on the number of threads
+	static constexpr offset_t segment_size = 64*1024*1024;
 
-	FileMap upd(key_); upd.size_ = datafile.size();
+	const std::vector<uint32_t> sizes = block_sizes();
+	const offset_t file_size = datafile.size();
+
+	std::vector<block_match> matches;
+	if(file_size <= segment_size){
+		scan_blocks<ChecksumT>(datafile, {0, file_size}, file_size, blockset, sizes, consumed, matches);
+		return matches;
+	}
+
+	// Segments are scanned independently, each one as if it was the only one. Windows may cross the end of a segment.
+	// At most concurrency_ segments are scanned at once, as each one holds its own buffers (see scan_blocks).
+	const size_t segment_count = size_t((file_size+segment_size-1) / segment_size);
+	std::vector<std::vector<block_match>> segment_candidates(segment_count);
+	auto scan_segment = [&](size_t i){
+		offset_t segment_offset = i*segment_size;
+		std::vector<bool> segment_consumed(blockset.size());
+		scan_blocks<ChecksumT>(datafile, {segment_offset, std::min(segment_size, file_size-segment_offset)}, file_size, blockset, sizes, segment_consumed, segment_candidates[i]);
+	};
+
+	if(concurrency_ <= 1){
+		for(size_t i = 0; i < segment_count; i++) scan_segment(i);
+	}else{
+		std::vector<std::future<void>> segment_scans;
+		try {
+			for(size_t i = 0; i < segment_count; i++){
+				if(i >= concurrency_) segment_scans[i-concurrency_].wait();
+				segment_scans.push_back(worker_pool().post([&, i]{scan_segment(i);}));
+			}
+		}catch(...){
+			for(auto& segment_scan : segment_scans) segment_scan.wait();	// Tasks reference locals
+			throw;
+		}
+		for(auto& segment_scan : segment_scans) segment_scan.wait();	// Tasks reference locals, even if one fails
+		for(auto& segment_scan : segment_scans) segment_scan.get();
+	}
+
+	// Reconciliation. Candidates are taken in offset order, so the result doesn't depend on scheduling. A candidate is
+	// dropped if it overlaps an accepted match (at a segment boundary), or if its block is already claimed.
+	std::vector<block_type> rescan_spaces;
+	offset_t covered_end = 0;
+	bool dropped = false;
+	for(auto& candidates : segment_candidates){
+		for(auto& candidate : candidates){
+			if(candidate.first < covered_end || consumed[candidate.second]){
+				dropped = true;
+				continue;
+			}
+			if(dropped){	// Space before this match may still contain matches, that were shadowed by dropped ones
+				rescan_spaces.push_back({covered_end, candidate.first-covered_end});
+				dropped = false;
+			}
+			consumed[candidate.second] = true;
+			matches.push_back(candidate);
+			covered_end = candidate.first + blockset[candidate.second]->enc_block_.blocksize_;
+		}
+	}
+	if(dropped) rescan_spaces.push_back({covered_end, file_size-covered_end});
+
+	// Spaces around dropped candidates are small, so they are scanned serially.
+	if(!rescan_spaces.empty()){
+		for(auto& space : rescan_spaces)
+			scan_blocks<ChecksumT>(datafile, space, space.first+space.second, blockset, sizes, consumed, matches);
+		std::sort(matches.begin(), matches.end());
+	}
+	return matches;
+}
+
+FileMap FileMap::make_update_map() const {
+	FileMap upd(key_);
+	upd.encryption_pool_ = encryption_pool_;
+	upd.concurrency_ = concurrency_;
+	upd.pool_ = pool_;
+	upd.inflight_data_limit_ = inflight_data_limit_;
+	upd.buffer_pool_ = buffer_pool_;
 	upd.maxblocksize_ = maxblocksize_;
 	upd.minblocksize_ = minblocksize_;
 	upd.strong_hash_type_ = strong_hash_type_;
 	upd.weak_hash_type_ = weak_hash_type_;
+	upd.chunking_type_ = chunking_type_;
+	upd.block_index_ = block_index_;
+	return upd;
+}
 
-	auto blocks_left = hashed_blocks_;       // This will move into upd one by one.
-
+std::vector<uint32_t> FileMap::block_sizes() const {
 	// Create a set of block sizes, sorted in descending order with power of 2 values before others.
 	struct greater_pow2_prio {
 		bool operator()(const uint32_t& lhs, const uint32_t& rhs){
@@ -53,107 +290,374 @@ FileMap FileMap::update(const std::string& path) {
 			return false;
 		}
 	};
-	std::set<uint32_t, greater_pow2_prio> block_sizes; for(auto block : offset_blocks_){block_sizes.insert(block.second->enc_block_.blocksize_);}
+	std::set<uint32_t, greater_pow2_prio> block_sizes; for(auto block : *offset_blocks_){block_sizes.insert(block.second->enc_block_.blocksize_);}
+	return std::vector<uint32_t>(block_sizes.begin(), block_sizes.end());
+}
+
+FileMap FileMap::update(const std::string& path) {
+	if(maxblocksize_ == 0) throw error("Maximum block size must be > 0");
+
+	File datafile(path);
+
+	FileMap upd = make_update_map();
+	upd.size_ = datafile.size();
+
+	// Content-defined chunks are stable under insertions, so the file is simply re-chunked and chunks are matched to old
+	// blocks by hash in one linear pass. No rolling is needed.
+	if(chunking_type_ == FASTCDC){
+		upd.create_blocks(datafile, upd.split_space(datafile, {0, upd.size_}), &hashed_blocks());
+		return upd;
+	}
+
+	const weakhash_index& blockset = hashed_blocks();
+	std::vector<bool> consumed(blockset.size());	// Every block is matched at most once
+
+	// Step 1: Try to match file to blocks we have. Block is matched by weakhash, and then by stronghash.
+	// Windows of all block sizes are checked in a single pass over the file.
+	// Large files are split into segments, which are scanned in parallel.
+	std::vector<block_match> matches;
+	switch(weak_hash_type_){
+		case RSYNC: matches = match_file<RsyncChecksum>(datafile, blockset, consumed); break;
+		case RSYNC64: matches = match_file<RsyncChecksum64>(datafile, blockset, consumed); break;
+		default: throw error("Unknown weak hash type");
+	}
 
 	AvailabilityMap<offset_t> av_map(upd.size_);
+	for(auto& match : matches){
+		upd.insert_block(match.first, blockset[match.second]);
+		av_map.insert({match.first, blockset[match.second]->enc_block_.blocksize_});
+	}
+
+	// Step 2: Unmatched blocks will be added to filemap
+	upd.fill_spaces(datafile, av_map);
 
-	// Step 1: Try to match file to blocks we have. Block is matched by weakhash, and then by stronghash
-	for(auto blocksize : block_sizes){
-		for(auto empty_block_it = av_map.begin(); empty_block_it != av_map.end(); ){
-			if(empty_block_it->second < blocksize) {empty_block_it++; continue;}
+	return upd;
+}
 
-			const offset_t orig_offset = empty_block_it->first;
+FileMap FileMap::update(const std::string& path, std::vector<std::pair<offset_t, offset_t>> dirty_ranges) {
+	if(maxblocksize_ == 0) throw error("Maximum block size must be > 0");
 
-			// Reading to block buffer
-			std::vector<uint8_t> tmp_blockbuf = datafile.get(orig_offset, blocksize);
-			StatefulRsyncChecksum checksum(tmp_blockbuf.begin(), tmp_blockbuf.end());
-			tmp_blockbuf.clear();
+	File datafile(path);
 
-			bool incremented_empty_block_it = false;
-			for(offset_t current_offset = orig_offset; current_offset+blocksize < orig_offset+empty_block_it->second; current_offset++) {
-				auto matched_it = match_block(checksum, blocks_left);
-				if(matched_it != blocks_left.end()) {   // Block matched successfully
-					log_matched(checksum, blocksize);
+	FileMap upd = make_update_map();
+	upd.size_ = datafile.size();
+
+	// Sorted and merged, so a block can be checked against them with one binary search
+	std::sort(dirty_ranges.begin(), dirty_ranges.end());
+	std::vector<block_type> merged_ranges;
+	for(auto& range : dirty_ranges){
+		if(range.second == 0) continue;
+		if(!merged_ranges.empty() && range.first <= merged_ranges.back().first+merged_ranges.back().second)
+			merged_ranges.back().second = std::max(merged_ranges.back().first+merged_ranges.back().second, range.first+range.second) - merged_ranges.back().first;
+		else
+			merged_ranges.push_back(range);
+	}
+	auto is_dirty = [&](offset_t offset, offset_t length){
+		// First range, that ends after offset
+		auto range_it = std::upper_bound(merged_ranges.begin(), merged_ranges.end(), offset, [](offset_t offset, const block_type& range){
+			return offset < range.first+range.second;
+		});
+		return range_it != merged_ranges.end() && range_it->first < offset+length;
+	};
 
-					empty_block_it = av_map.insert({current_offset, blocksize}).first;
-					incremented_empty_block_it = true;
-					blocks_left.erase(matched_it);
-					break;
-				}
-				checksum.roll(datafile.get(++current_offset));
-			}
-			if(!incremented_empty_block_it) empty_block_it++;
+	const weakhash_index& blockset = hashed_blocks();
+	std::vector<bool> consumed(blockset.size());
+
+	// Step 1: Blocks outside of dirty ranges and inside the new size are kept, without reading them.
+	// Block numbers in blockset follow offset order.
+	AvailabilityMap<offset_t> av_map(upd.size_);
+	size_t block_number = 0;
+	for(auto& offset_block : *offset_blocks_){
+		offset_t blocksize = offset_block.second->enc_block_.blocksize_;
+		if(offset_block.first+blocksize <= upd.size_ && !is_dirty(offset_block.first, blocksize)){
+			upd.insert_block(offset_block.first, offset_block.second);
+			av_map.insert({offset_block.first, blocksize});
+			consumed[block_number] = true;
 		}
+		block_number++;
 	}
 
-	// Step 2: Unmatched blocks will be added to filemap
-	for(auto empty_block : av_map){
-		log_unmatched(empty_block.first, empty_block.second);
+	std::vector<block_type> spaces(av_map.begin(), av_map.end());
+	if(chunking_type_ == FASTCDC){
+		for(auto& space : spaces)
+			upd.create_blocks(datafile, upd.split_space(datafile, space), &blockset);
+		return upd;
+	}
 
-		auto lb_block = upd.offset_blocks_.lower_bound(empty_block.first);
-		std::shared_ptr<DecryptedBlock> left_blk, right_blk;
-		if(lb_block != upd.offset_blocks_.end())    right_blk = lb_block->second;
-		if(lb_block != upd.offset_blocks_.begin())  left_blk = (--lb_block)->second;
+	// Step 2: Only the spaces around dirty ranges are rolled, for blocks moved within them
+	std::vector<block_match> matches;
+	const std::vector<uint32_t> sizes = block_sizes();
+	for(auto& space : spaces){
+		switch(weak_hash_type_){
+			case RSYNC: scan_blocks<RsyncChecksum>(datafile, space, space.first+space.second, blockset, sizes, consumed, matches); break;
+			case RSYNC64: scan_blocks<RsyncChecksum64>(datafile, space, space.first+space.second, blockset, sizes, consumed, matches); break;
+			default: throw error("Unknown weak hash type");
+		}
+	}
+	for(auto& match : matches){
+		upd.insert_block(match.first, blockset[match.second]);
+		av_map.insert({match.first, blockset[match.second]->enc_block_.blocksize_});
+	}
+
+	// Step 3: Unmatched blocks will be added to filemap
+	upd.fill_spaces(datafile, av_map);
 
-		upd.create_neighbormap(datafile, left_blk, right_blk, empty_block);
+	return upd;
+}
+
+FileMap FileMap::update(std::istream& datastream) {
+	return update(istream_callback(datastream));
+}
+
+FileMap FileMap::update(const ReadCallback& read) {
+	FileMap upd = make_update_map();
+
+	if(chunking_type_ == FASTCDC){
+		upd.fill_with_stream(read, &hashed_blocks());
+		return upd;
 	}
 
+	switch(weak_hash_type_){
+		case RSYNC: update_stream<RsyncChecksum>(read, upd); break;
+		case RSYNC64: update_stream<RsyncChecksum64>(read, upd); break;
+		default: throw error("Unknown weak hash type");
+	}
 	return upd;
 }
 
+template<class ChecksumT>
+void FileMap::update_stream(const ReadCallback& read, FileMap& upd) {
+	if(maxblocksize_ == 0) throw error("Maximum block size must be > 0");
+
+	const weakhash_index& blockset = hashed_blocks();
+	std::vector<bool> consumed(blockset.size());
+	const std::vector<uint32_t> sizes = block_sizes();
+	const uint32_t largest_size = sizes.empty() ? 0 : *std::max_element(sizes.begin(), sizes.end());
+
+	// One checksum per block size. Each one covers the last sizes[i] bytes of pending, so all of them are advanced
+	// by a single read of the stream.
+	std::vector<ChecksumT> checksums(sizes.size());
+
+	// Data after the last matched block. Unmatched data is flushed as new blocks, when pending becomes longer than
+	// maxblocksize_ + largest_size.
+	// One reservation for both pending and input: a second one could wait for the first.
+	BufferPool::Reservation reservation(buffer_pool_.get(), (size_t)maxblocksize_+largest_size+File::sequential_read_size);
+	blob pending; pending.reserve((size_t)maxblocksize_+largest_size);
+	offset_t pending_offset = 0;
+
+	BlockQueue queue(upd);
+	auto flush_pending = [&](size_t length) {
+		for(size_t flushed = 0; flushed < length; ){
+			size_t block_size = std::min(length-flushed, (size_t)maxblocksize_);
+			log_unmatched(pending_offset+flushed, (uint32_t)block_size);
+			BufferPool::Buffer block_data = acquire_buffer(block_size);
+			std::copy(pending.begin()+flushed, pending.begin()+flushed+block_size, block_data->begin());
+			queue.push(pending_offset+flushed, std::move(block_data));
+			flushed += block_size;
+		}
+		pending.erase(pending.begin(), pending.begin()+length);
+		pending_offset += length;
+	};
+
+	blob input(File::sequential_read_size);
+	size_t input_size;
+	while((input_size = read_full(read, input.data(), input.size())) != 0){
+		for(size_t input_pos = 0; input_pos < input_size; input_pos++){
+			uint8_t in = input[input_pos];
+			pending.push_back(in);
+
+			for(size_t i = 0; i < sizes.size(); i++){
+				if(pending.size() == sizes[i])
+					checksums[i].compute(pending.data(), pending.size());
+				else if(pending.size() > sizes[i])
+					checksums[i].roll(pending[pending.size()-1-sizes[i]], in);
+			}
+
+			bool matched = false;
+			for(size_t i = 0; i < sizes.size() && !matched; i++){	// sizes are already in order of preference
+				if(pending.size() < sizes[i]) continue;
+
+				size_t matched_block = match_block(checksums[i].value(), pending.data()+pending.size()-sizes[i], sizes[i], blockset, &consumed);
+				if(matched_block != weakhash_index::npos){
+					log_matched(checksums[i].value(), sizes[i]);
+
+					flush_pending(pending.size()-sizes[i]);
+					upd.insert_block(pending_offset, blockset[matched_block]);
+					consumed[matched_block] = true;
+
+					pending_offset += sizes[i];
+					pending.clear();
+					matched = true;
+				}
+			}
+
+			if(!matched && pending.size() >= (size_t)maxblocksize_+largest_size)
+				flush_pending(maxblocksize_);
+		}
+	}
+	flush_pending(pending.size());
+
+	queue.finish();
+	upd.size_ = pending_offset;
+}
+
 DecryptedBlock FileMap::process_block(const std::vector<uint8_t>& data) {
-	CryptoPP::AutoSeededRandomPool rng;
+	SigningContext& context = SigningContext::local();
 
 	DecryptedBlock block;
 	block.enc_block_.blocksize_ = (uint32_t)data.size();
 
-	block.enc_block_.iv_.resize(16);
-	rng.GenerateBlock(block.enc_block_.iv_.data(), 16);
-
-	block.enc_block_.encrypted_data_hash_ = compute_strong_hash( encrypt_block(data, key_, block.enc_block_.iv_) , strong_hash_type_);
+	context.rng().GenerateBlock(block.enc_block_.iv_.data(), block.enc_block_.iv_.size());
 
-	block.strong_hash_ = compute_strong_hash(data, strong_hash_type_);
-	block.weak_hash_ = RsyncChecksum(data.begin(), data.end());
+	auto cipher = encryption_pool_->acquire(block.enc_block_.iv_.data());
+	switch(weak_hash_type_){
+		case RSYNC: sign_block<RsyncChecksum>(data.data(), data.size(), block, context, *cipher); break;
+		case RSYNC64: sign_block<RsyncChecksum64>(data.data(), data.size(), block, context, *cipher); break;
+		default: throw error("Unknown weak hash type");
+	}
 
-	block.encrypt_hashes(key_);
+	cipher->Resynchronize(block.enc_block_.iv_.data());
+	block.encrypt_hashes(*cipher, weak_hash_type_);
 
 	return block;
 }
 
-FileMap::weakhash_map::iterator FileMap::match_block(const StatefulRsyncChecksum& checksum, weakhash_map& blockset) {
-	auto eqhash_blocks = blockset.equal_range(checksum);
+template<class ChecksumT>
+void FileMap::sign_block(const uint8_t* data, size_t size, DecryptedBlock& block, SigningContext& context, EncryptionPool::Encryption& cipher) {
+	static constexpr size_t tile_size = 64*1024;	// Fits in L2 together with its ciphertext. Multiple of AES block size.
+	static constexpr size_t aes_block_size = CryptoPP::AES::BLOCKSIZE;
 
-	if(eqhash_blocks.first != eqhash_blocks.second){
-		blob datablock = blob(checksum.state_buffer().begin(), checksum.state_buffer().end());
-		blob strong_hash = compute_strong_hash(datablock, strong_hash_type_);
-		for(auto eqhash_block = eqhash_blocks.first; eqhash_block != eqhash_blocks.second; eqhash_block++){
-			if(strong_hash == eqhash_block->second->strong_hash_){
-				return eqhash_block;
-			}
+	uint8_t* encrypted_tile = context.buffer(tile_size+aes_block_size);
+
+	ChecksumT checksum;
+	StrongHasher& plaintext_hasher = context.plaintext_hasher(strong_hash_type_);
+	StrongHasher& ciphertext_hasher = context.ciphertext_hasher(strong_hash_type_);
+
+	for(size_t tile_offset = 0; tile_offset < size; tile_offset += tile_size){
+		const uint8_t* tile = data+tile_offset;
+		size_t tile_bytes = std::min(tile_size, size-tile_offset);
+
+		checksum.update(tile, tile_bytes);
+		plaintext_hasher.update(tile, tile_bytes);
+
+		size_t aligned_bytes = tile_bytes - tile_bytes % aes_block_size;
+		cipher.ProcessData(encrypted_tile, tile, aligned_bytes);
+
+		size_t encrypted_bytes = aligned_bytes;
+		if(aligned_bytes != tile_bytes){	// Only the last tile. Same PKCS#7 padding as encrypt_block() uses for unaligned blocks.
+			std::array<uint8_t, aes_block_size> last_block;
+			uint8_t padding = uint8_t(aes_block_size - (tile_bytes - aligned_bytes));
+			std::fill(std::copy(tile+aligned_bytes, tile+tile_bytes, last_block.begin()), last_block.end(), padding);
+			cipher.ProcessData(encrypted_tile+aligned_bytes, last_block.data(), aes_block_size);
+			encrypted_bytes += aes_block_size;
 		}
+
+		ciphertext_hasher.update(encrypted_tile, encrypted_bytes);
 	}
-	return hashed_blocks_.end();
+
+	block.weak_hash_ = checksum.value();
+	block.strong_hash_ = plaintext_hasher.final();
+	block.enc_block_.encrypted_data_hash_ = ciphertext_hasher.final();
+}
+
+size_t FileMap::match_block(weakhash_t weak_hash, const uint8_t* data, uint32_t size, const weakhash_index& blockset, const std::vector<bool>* consumed) {
+	strong_hash_t strong_hash; bool strong_hash_computed = false;
+	return blockset.find_if(weak_hash, [&](size_t n){
+		if((consumed && (*consumed)[n]) || blockset[n]->enc_block_.blocksize_ != size) return false;
+		if(!strong_hash_computed){	// Hashed in place, no copy of the window is made
+			strong_hash = StrongHasher::local(strong_hash_type_).update(data, size).final();
+			strong_hash_computed = true;
+		}
+		return strong_hash == blockset[n]->strong_hash_;
+	});
 }
 
 void FileMap::set_blocks(const std::vector<Block>& new_blocks) {
 	EncFileMap::set_blocks(new_blocks);
-	hashed_blocks_.clear();
-	for(auto block : offset_blocks_){
-		block.second->decrypt_hashes(key_);
-		hashed_blocks_.insert(std::make_pair(block.second->weak_hash_, block.second));
+	decrypt_blocks();
+}
+
+void FileMap::deserialize(const uint8_t* data, size_t size) {
+	EncFileMap::deserialize(data, size);
+	decrypt_blocks();
+}
+
+void FileMap::decrypt_blocks() {
+	static constexpr size_t batch_size = 16*1024;
+
+	std::vector<std::shared_ptr<DecryptedBlock>> blocks; blocks.reserve(offset_blocks_->size());
+	for(auto& block : *offset_blocks_) blocks.push_back(block.second);
+
+	// Each batch expands the key schedule once, then only resynchronizes the cipher with IV of every block.
+	auto decrypt_batch = [this, &blocks](size_t first, size_t last){
+		CryptoPP::CBC_Mode<CryptoPP::AES>::Decryption cipher;
+		cipher.SetKeyWithIV(key_.data(), key_.size(), blocks[first]->enc_block_.iv_.data(), CryptoPP::AES::BLOCKSIZE);
+		for(size_t i = first; i < last; i++){
+			cipher.Resynchronize(blocks[i]->enc_block_.iv_.data());
+			blocks[i]->decrypt_hashes(cipher, weak_hash_type_);
+		}
+	};
+
+	if(concurrency_ <= 1 || blocks.size() <= batch_size){
+		if(!blocks.empty()) decrypt_batch(0, blocks.size());
+	}else{
+		std::vector<std::future<void>> batches;
+		for(size_t first = 0; first < blocks.size(); first += batch_size)
+			batches.push_back(worker_pool().post([&, first]{decrypt_batch(first, std::min(first+batch_size, blocks.size()));}));
+		for(auto& batch : batches) batch.wait();	// Tasks reference locals, even if one fails
+		for(auto& batch : batches) batch.get();
 	}
+
+	hashed_blocks_dirty_ = true;	// Rebuilt in one step, when it is needed
 }
 
-std::shared_ptr<DecryptedBlock> FileMap::create_block(File& datafile, block_type unassigned_space, int num){
-	std::shared_ptr<DecryptedBlock> processed_block = std::make_shared<DecryptedBlock>(process_block(datafile.get(unassigned_space.first, unassigned_space.second)));
+const FileMap::weakhash_index& FileMap::hashed_blocks() {
+	if(hashed_blocks_dirty_){
+		std::vector<uint64_t> weak_hashes; weak_hashes.reserve(offset_blocks_->size());
+		std::vector<std::shared_ptr<DecryptedBlock>> blocks; blocks.reserve(offset_blocks_->size());
+		for(auto& block : *offset_blocks_){
+			weak_hashes.push_back(block.second->weak_hash_);
+			blocks.push_back(block.second);
+		}
+		auto new_hashed_blocks = std::make_shared<weakhash_index>();	// Not modified in place, as copies may share it
+		new_hashed_blocks->assign(std::move(weak_hashes), std::move(blocks));
+		hashed_blocks_ = std::move(new_hashed_blocks);
+		hashed_blocks_dirty_ = false;
+	}
+	return *hashed_blocks_;
+}
 
-	print_debug_block(*processed_block, num);
+std::shared_ptr<DecryptedBlock> FileMap::create_block(const blob& data, offset_t offset, int num, const weakhash_index* reused_blocks){
+	if(reused_blocks || block_index_){	// Read-only access to both, so it is safe from multiple tasks.
+		weakhash_t weak_hash = compute_weak_hash(data.data(), data.size());
+
+		// Look for the same block in the old map first, then in the shared index
+		std::shared_ptr<DecryptedBlock> known_block;
+		if(reused_blocks){
+			size_t matched_block = match_block(weak_hash, data.data(), (uint32_t)data.size(), *reused_blocks);
+			if(matched_block != weakhash_index::npos) known_block = (*reused_blocks)[matched_block];
+		}
+		if(!known_block && block_index_)
+			known_block = block_index_->find(weak_hash, data.data(), (uint32_t)data.size());
 
-	hashed_blocks_.insert({processed_block->weak_hash_, processed_block});	// TODO: We have a great race condition here. MUST BE FIXED!
-	offset_blocks_.insert({unassigned_space.first, processed_block});	// TODO: Also here. Protect hashed_blocks, offset_blocks!
+		if(known_block){
+			log_matched(weak_hash, data.size());
+			return known_block;
+		}
+		log_unmatched(offset, (uint32_t)data.size());
+	}
+
+	std::shared_ptr<DecryptedBlock> processed_block = std::make_shared<DecryptedBlock>(process_block(data));
+
+	print_debug_block(*processed_block, num);
 	return processed_block;
 }
 
+void FileMap::insert_block(offset_t offset, std::shared_ptr<DecryptedBlock> block) {
+	offset_blocks_.write().insert({offset, std::move(block)});
+	hashed_blocks_dirty_ = true;
+}
+
 void FileMap::create_neighbormap(File& datafile,
 		std::shared_ptr<DecryptedBlock> left, std::shared_ptr<DecryptedBlock> right,
 		block_type unassigned_space) {
@@ -163,8 +667,8 @@ void FileMap::create_neighbormap(File& datafile,
 		if(left->enc_block_.blocksize_ < maxblocksize_){
 			unassigned_space.first -= left->enc_block_.blocksize_;
 			unassigned_space.second += left->enc_block_.blocksize_;
-			hashed_blocks_.erase(left->weak_hash_);
-			offset_blocks_.erase(unassigned_space.first);
+			offset_blocks_.write().erase(unassigned_space.first);
+			hashed_blocks_dirty_ = true;
 		}
 		fill_with_map(datafile, unassigned_space);
 	}else{	// FIXME: Dirty hack. We need some more logic here.
@@ -172,35 +676,148 @@ void FileMap::create_neighbormap(File& datafile,
 	}
 }
 
+void FileMap::fill_spaces(File& datafile, AvailabilityMap<offset_t>& av_map) {
+	for(auto empty_block : av_map){
+		log_unmatched(empty_block.first, empty_block.second);
+
+		auto lb_block = offset_blocks_->lower_bound(empty_block.first);
+		std::shared_ptr<DecryptedBlock> left_blk, right_blk;
+		if(lb_block != offset_blocks_->end())    right_blk = lb_block->second;
+		if(lb_block != offset_blocks_->begin())  left_blk = (--lb_block)->second;
+
+		create_neighbormap(datafile, left_blk, right_blk, empty_block);
+	}
+}
+
 void FileMap::fill_with_map(File& datafile, block_type unassigned_space) {
-	if(unassigned_space.second == 0) return;
+	create_blocks(datafile, split_space(datafile, unassigned_space));
+}
 
-	std::vector<std::shared_ptr<std::packaged_task<void()>>> tasks;
+std::vector<FileMap::block_type> FileMap::split_space(File& datafile, block_type unassigned_space) const {
+	std::vector<block_type> spaces;
+	if(chunking_type_ == FASTCDC){
+		FastCDC chunker(minblocksize_, maxblocksize_);
+
+		// Sliding buffer, holding at least one maximum-sized chunk ahead, unless the space ends earlier.
+		BufferPool::Reservation reservation(buffer_pool_.get(), (size_t)maxblocksize_+File::sequential_read_size);
+		blob buffer; size_t buffer_pos = 0;
+		offset_t buffer_end = unassigned_space.first;
+		const offset_t space_end = unassigned_space.first+unassigned_space.second;
+
+		while(unassigned_space.second != 0){
+			if(buffer.size()-buffer_pos < maxblocksize_ && buffer_end < space_end){
+				buffer.erase(buffer.begin(), buffer.begin()+buffer_pos); buffer_pos = 0;
+				auto bytes_to_read = (size_t)std::min<offset_t>(space_end - buffer_end, File::sequential_read_size);
+				buffer.resize(buffer.size()+bytes_to_read);
+				datafile.read(buffer_end, (uint32_t)bytes_to_read, buffer.data()+buffer.size()-bytes_to_read);
+				buffer_end += bytes_to_read;
+			}
 
-	io_service io_service_instance; // FIXME: Warning! Temporary code.
+			uint32_t chunk_size = chunker.cut(buffer.data()+buffer_pos, buffer.size()-buffer_pos);
+			spaces.push_back({unassigned_space.first, chunk_size});
+			buffer_pos += chunk_size;
+			unassigned_space.first += chunk_size;
+			unassigned_space.second -= chunk_size;
+		}
+	}else{
+		while(unassigned_space.second != 0){
+			uint32_t bytes_to_read = (uint32_t)std::min(unassigned_space.second, (uint64_t)maxblocksize_);
+			spaces.push_back({unassigned_space.first, bytes_to_read});
+			unassigned_space.first += bytes_to_read;
+			unassigned_space.second -= bytes_to_read;
+		}
+	}
+	return spaces;
+}
+
+void FileMap::create_blocks(File& datafile, const std::vector<block_type>& spaces, const weakhash_index* reused_blocks) {
+	BlockQueue queue(*this, reused_blocks);
+
+	// Blocks are read in batches, so the file backend can keep their reads in flight together. A batch is at least as
+	// large as the queue and File::sequential_read_size, unless the memory budget runs out first. The queue may be as
+	// short as 2 blocks, which alone wouldn't keep a deep queue on the device.
+	const size_t batch_size = max_inflight_blocks();
+	std::vector<BufferPool::Buffer> batch;
+	std::vector<File::ReadRequest> requests;
+	uint64_t batch_bytes = 0;
+	auto flush_batch = [&]{
+		datafile.read_batch(requests);
+		for(size_t i = 0; i < batch.size(); i++)
+			queue.push(requests[i].offset, std::move(batch[i]));
+		batch.clear(); requests.clear();
+		batch_bytes = 0;
+	};
+
+	for(auto& space : spaces){
+		BufferPool::Buffer buffer;
+		if(!try_acquire_buffer((size_t)space.second, buffer)){
+			flush_batch();	// Buffers of the batch return to the budget only after it is signed, so it can't wait with them
+			buffer = acquire_buffer((size_t)space.second);
+		}
+		requests.push_back({space.first, (uint32_t)space.second, buffer->data()});
+		batch.push_back(std::move(buffer));
+		batch_bytes += space.second;
 
-	while(unassigned_space.second != 0){
-		size_t bytes_to_read = std::min(unassigned_space.second, (uint64_t)maxblocksize_);
-		tasks.emplace_back(
-			std::make_shared<std::packaged_task<void()>>(
-				std::bind(&FileMap::create_block, this, std::ref(datafile), block_type{unassigned_space.first, bytes_to_read}, tasks.size())
-			)
-		);
-		io_service_instance.post(std::bind(&std::packaged_task<void()>::operator(), tasks.back()));
-		unassigned_space.first += bytes_to_read;
-		unassigned_space.second -= bytes_to_read;
+		if(batch.size() >= batch_size && batch_bytes >= File::sequential_read_size) flush_batch();
 	}
+	flush_batch();
+	queue.finish();
+}
+
+void FileMap::set_block_index(std::shared_ptr<BlockIndex> block_index) {
+	if(block_index && !block_index->compatible(*this)) throw error("Block index has different key or hash types than map");
+	block_index_ = std::move(block_index);
+}
+
+ThreadPool& FileMap::worker_pool() {
+	if(!pool_ || pool_->size() != concurrency_)
+		pool_ = std::make_shared<ThreadPool>(concurrency_);
+	return *pool_;
+}
 
-	io_service_instance.run();
+void FileMap::set_concurrency(unsigned new_concurrency) {
+	concurrency_ = std::max(new_concurrency, 1u);
+}
+
+void FileMap::set_inflight_data_limit(uint64_t new_inflight_data_limit) {
+	inflight_data_limit_ = new_inflight_data_limit;
+	buffer_pool_ = inflight_data_limit_ != 0 ? std::make_shared<BufferPool>(inflight_data_limit_) : nullptr;
+}
+
+void FileMap::share_inflight_data_limit(const FileMap& other) {
+	if(other.inflight_data_limit_ == 0) return;
+	inflight_data_limit_ = other.inflight_data_limit_;
+	buffer_pool_ = other.buffer_pool_;
+}
+
+BufferPool::Buffer FileMap::acquire_buffer(size_t size) {
+	return buffer_pool_ ? buffer_pool_->acquire(size) : BufferPool::Buffer(blob(size));
+}
+
+bool FileMap::try_acquire_buffer(size_t size, BufferPool::Buffer& buffer) {
+	if(buffer_pool_) return buffer_pool_->try_acquire(size, buffer);
+	buffer = BufferPool::Buffer(blob(size));
+	return true;
+}
+
+size_t FileMap::max_inflight_blocks() const {
+	size_t max_inflight = 2*concurrency_;
+	if(inflight_data_limit_ != 0)
+		max_inflight = (size_t)std::max<uint64_t>(std::min<uint64_t>(max_inflight, inflight_data_limit_ / std::max(maxblocksize_, 1u)), 1);
+	return max_inflight;
+}
 
-	for(auto& task : tasks){
-		task->get_future().wait();
+weakhash_t FileMap::compute_weak_hash(const uint8_t* data, size_t size) const {
+	switch(weak_hash_type_){
+		case RSYNC: return RsyncChecksum(data, size);
+		case RSYNC64: return RsyncChecksum64(data, size);
+		default: throw error("Unknown weak hash type");
 	}
 }
 
 void FileMap::log_matched(weakhash_t checksum, size_t size) {
 	if(logger){
-		std::ostringstream hex_checksum; hex_checksum << "0x" << std::hex << std::setfill('0') << std::setw(8) << checksum;
+		std::ostringstream hex_checksum; hex_checksum << "0x" << std::hex << std::setfill('0') << std::setw((int)DecryptedBlock::weak_hash_size(weak_hash_type_)*2) << checksum;
 		logger->debug() << "Matched block: " << hex_checksum.str() << " size=" << size;
 	}
 }
@@ -18,37 +18,136 @@
 #include "EncFileMap.h"
 #include "util/File.h"
 #include "util/AvailabilityMap.h"
-#include "crypto/StatefulRsyncChecksum.h"
+#include "util/BufferPool.h"
+#include "util/ThreadPool.h"
+#include "util/WeakHashIndex.h"
+#include "crypto/FastCDC.h"
+#include "crypto/EncryptionPool.h"
+#include "crypto/SigningContext.h"
 
 namespace cryptodiff {
 namespace internals {
 
+class BlockIndex;
+
 class FileMap : public EncFileMap {
 public:
 	FileMap(blob key);
+	FileMap(const FileMap& filemap) = default;
+	FileMap(FileMap&& filemap) = default;
+	FileMap& operator=(const FileMap& filemap) = default;
+	FileMap& operator=(FileMap&& filemap) = default;
 	virtual ~FileMap();
 
+	virtual FileMap* clone() const {return new FileMap(*this);}
+
 	void create(const std::string& path);
+	void create(std::istream& datastream);
+	void create(const ReadCallback& read);
+
 	FileMap update(const std::string& path);
+	// Only data in dirty_ranges (offset, length) has changed, apart from the size of the file. Old blocks outside of them
+	// are kept without reading, and only spaces around dirty ranges are matched and signed.
+	FileMap update(const std::string& path, std::vector<std::pair<offset_t, offset_t>> dirty_ranges);
+	FileMap update(std::istream& datastream);
+	FileMap update(const ReadCallback& read);
 
 	void set_blocks(const std::vector<Block>& new_blocks);
+	void deserialize(const uint8_t* data, size_t size);
+
+	unsigned concurrency() const {return concurrency_;}
+	void set_concurrency(unsigned new_concurrency);
+
+	// Budget for file data in flight: buffers of blocks being read and signed, and of matching. 0 means no limit.
+	uint64_t inflight_data_limit() const {return inflight_data_limit_;}
+	void set_inflight_data_limit(uint64_t new_inflight_data_limit);
+	// Makes this map draw from the same budget as other, so both stay within one limit together. Does nothing, if other
+	// has no limit: this map keeps its own.
+	void share_inflight_data_limit(const FileMap& other);
+
+	// Empty map with the same key and parameters, to be filled by create() or update()
+	FileMap make_update_map() const;
+
+	// New blocks are looked up in block_index first, and taken from it if found. Set to nullptr to disable.
+	void set_block_index(std::shared_ptr<BlockIndex> block_index);
 
 protected:
 	using block_type = AvailabilityMap<offset_t>::block_type;    // offset, length.
-	using weakhash_map = std::unordered_multimap<weakhash_t, std::shared_ptr<DecryptedBlock>>;
+	using weakhash_index = WeakHashIndex<std::shared_ptr<DecryptedBlock>>;
 
-	weakhash_map hashed_blocks_;
+	// Built lazily from offset_blocks_, as it is only needed to update this map.
+	std::shared_ptr<const weakhash_index> hashed_blocks_;	// Shared between copies, like offset_blocks_
+	bool hashed_blocks_dirty_ = true;
+	const weakhash_index& hashed_blocks();
 	blob key_;
+	std::shared_ptr<EncryptionPool> encryption_pool_;	// Keyed with key_. Shared between copies, like offset_blocks_
+	std::shared_ptr<BlockIndex> block_index_;
+
+	unsigned concurrency_ = ThreadPool::default_size();
+	std::shared_ptr<ThreadPool> pool_;	// Shared with maps, produced by update().
+	ThreadPool& worker_pool();	// Creates pool_ with concurrency_ threads, if needed
+
+	uint64_t inflight_data_limit_ = 0;
+	std::shared_ptr<BufferPool> buffer_pool_;	// Set with inflight_data_limit_. Shared with maps, produced by update().
+	// Buffers from buffer_pool_, or plain ones without a limit
+	BufferPool::Buffer acquire_buffer(size_t size);
+	bool try_acquire_buffer(size_t size, BufferPool::Buffer& buffer);
+	// Blocks, that are read or signed at once. Bounded by concurrency_, and by inflight_data_limit_ for blocks of maximum
+	// size.
+	size_t max_inflight_blocks() const;
 
 	// Subroutines for creating block signature
 	DecryptedBlock process_block(const std::vector<uint8_t>& data);
+	// Feeds data to the weak checksum, both strong hashes and the cipher in one pass of cache-sized tiles
+	template<class ChecksumT>
+	void sign_block(const uint8_t* data, size_t size, DecryptedBlock& block, SigningContext& context, EncryptionPool::Encryption& cipher);
 
-	std::shared_ptr<DecryptedBlock> create_block(File& datafile, block_type unassigned_space, int num = 0);
+	class BlockQueue;
+
+	// If reused_blocks is set, blocks with the same contents are taken from it instead of being created anew.
+	std::shared_ptr<DecryptedBlock> create_block(const blob& data, offset_t offset, int num = 0, const weakhash_index* reused_blocks = nullptr);
+	void create_blocks(File& datafile, const std::vector<block_type>& spaces, const weakhash_index* reused_blocks = nullptr);
+	void insert_block(offset_t offset, std::shared_ptr<DecryptedBlock> block);
+
+	// Splits space into blocks, according to chunking_type_
+	std::vector<block_type> split_space(File& datafile, block_type unassigned_space) const;
 	void fill_with_map(File& datafile, block_type unassigned_space);
+	// Signs free spaces of av_map as new blocks, merging them with neighbors where possible
+	void fill_spaces(File& datafile, AvailabilityMap<offset_t>& av_map);
+	void fill_with_stream(const ReadCallback& read, const weakhash_index* reused_blocks = nullptr);
 	void create_neighbormap(File& datafile, std::shared_ptr<DecryptedBlock> left, std::shared_ptr<DecryptedBlock> right, block_type unassigned_space);
 
+	// Distinct block sizes of this map, in order of matching preference
+	std::vector<uint32_t> block_sizes() const;
+
+	weakhash_t compute_weak_hash(const uint8_t* data, size_t size) const;
+
+	// Decrypts hashes of all blocks and rebuilds hashed_blocks_
+	void decrypt_blocks();
+
+	// Matches the stream against this map in one forward pass, using bounded memory.
+	template<class ChecksumT>
+	void update_stream(const ReadCallback& read, FileMap& upd);
+
+	using block_match = std::pair<offset_t, size_t>;	// offset, number of the block in weakhash_index.
+
+	// Checks windows of every size, starting at each offset of space and ending before data_end, in one pass. Matched
+	// blocks are appended to matches in offset order and marked consumed. Matching resumes right after a matched block.
+	// Size preference applies per offset: the leftmost match wins, even if a preferred size would match a bit later.
+	// Holds less than largest size plus File::sequential_read_size of data, and 8 bytes of prefix sums per data byte.
+	template<class ChecksumT>
+	void scan_blocks(File& datafile, block_type space, offset_t data_end, const weakhash_index& blockset, const std::vector<uint32_t>& sizes, std::vector<bool>& consumed, std::vector<block_match>& matches);
+	// Matches the whole file, scanning its 64 MiB segments in parallel. Returns non-overlapping matches in offset order.
+	// Result is the same for any concurrency. Buffers of scan_blocks are held for concurrency_ segments at once: about
+	// 9*(largest block size + File::sequential_read_size) each, or less, if memory is limited.
+	template<class ChecksumT>
+	std::vector<block_match> match_file(File& datafile, const weakhash_index& blockset, std::vector<bool>& consumed);
+
 	// Subroutine for matching blockbuf with defined checksum and existing block signature from blockset.
-	weakhash_map::iterator match_block(const StatefulRsyncChecksum& checksum, weakhash_map& blockset);
+	// Returns number of the matched block in blockset, or weakhash_index::npos. Blocks marked in consumed are skipped.
+	size_t match_block(weakhash_t weak_hash, const uint8_t* data, uint32_t size, const weakhash_index& blockset, const std::vector<bool>* consumed = nullptr);
+
+	friend class BlockIndex;
 
 	void log_matched(weakhash_t checksum, size_t size);
 	void log_unmatched(offset_t offset, uint32_t size);
@@ -0,0 +1,89 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <cryptopp/aes.h>
+#include <cryptopp/modes.h>
+#include <cryptopp/secblock.h>
+#include <boost/noncopyable.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * AES-CBC encryptors, keyed once with the key of a map and reused for its blocks: taking one only resynchronizes it with
+ * the IV of the block. There are as many encryptors, as there were blocks signed at once.
+ *
+ * Owned by the map (and shared by its copies), so the key and the expanded key schedules are wiped, when the map is
+ * gone. Crypto++ keeps both in SecBlocks, which are zeroed on destruction.
+ */
+class EncryptionPool : boost::noncopyable {
+public:
+	using Encryption = CryptoPP::CBC_Mode<CryptoPP::AES>::Encryption;
+
+	// Returns its encryptor to the pool on destruction
+	class Lease {
+	public:
+		Lease(EncryptionPool& pool, std::unique_ptr<Encryption> encryption) : pool_(pool), encryption_(std::move(encryption)) {}
+		Lease(Lease&& lease) = default;
+		~Lease() {pool_.put_back(std::move(encryption_));}
+
+		Encryption& operator*() {return *encryption_;}
+		Encryption* operator->() {return encryption_.get();}
+	private:
+		EncryptionPool& pool_;
+		std::unique_ptr<Encryption> encryption_;
+	};
+
+	EncryptionPool(const std::vector<uint8_t>& key) : key_(key.data(), key.size()) {}
+
+	// Encryptor, synchronized with iv
+	Lease acquire(const uint8_t* iv) {
+		std::unique_ptr<Encryption> encryption;
+		{
+			std::lock_guard<std::mutex> lk(mutex_);
+			if(!free_.empty()){
+				encryption = std::move(free_.back());
+				free_.pop_back();
+			}
+		}
+
+		if(encryption)
+			encryption->Resynchronize(iv);
+		else{
+			encryption.reset(new Encryption());
+			encryption->SetKeyWithIV(key_.data(), key_.size(), iv, CryptoPP::AES::BLOCKSIZE);
+		}
+		return Lease(*this, std::move(encryption));
+	}
+
+private:
+	const CryptoPP::SecByteBlock key_;
+
+	std::mutex mutex_;
+	std::vector<std::unique_ptr<Encryption>> free_;
+
+	void put_back(std::unique_ptr<Encryption> encryption) {
+		if(!encryption) return;
+		std::lock_guard<std::mutex> lk(mutex_);
+		free_.push_back(std::move(encryption));
+	}
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
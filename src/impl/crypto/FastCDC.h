@@ -0,0 +1,94 @@
+/* Copyright (C) 2014-2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Content-defined chunker, using Gear rolling hash with normalized chunking, as described in "FastCDC: a Fast and
+ * Efficient Content-Defined Chunking Approach for Data Deduplication" (Xia et al., 2016).
+ * Cut points depend only on the data after the previous cut point, so they are stable under insertions and removals.
+ */
+class FastCDC {
+	uint32_t min_size_, avg_size_, max_size_;
+	uint64_t mask_small_, mask_large_;
+
+	static const std::array<uint64_t, 256>& gear_table() {
+		// Generated by splitmix64, so the table (and every chunk boundary) is the same on every platform.
+		static const std::array<uint64_t, 256> table = []{
+			std::array<uint64_t, 256> t;
+			uint64_t state = 0x6a09e667f3bcc908ULL;
+			for(auto& value : t){
+				uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				value = z ^ (z >> 31);
+			}
+			return t;
+		}();
+		return table;
+	}
+
+	static uint64_t top_bits_mask(unsigned bits) {
+		bits = std::min(std::max(bits, 1u), 63u);
+		return ~uint64_t(0) << (64 - bits);
+	}
+public:
+	FastCDC(uint32_t min_size, uint32_t max_size) {
+		min_size_ = std::max(min_size, 1u);
+		max_size_ = std::max(max_size, min_size_);
+
+		// Average chunk size is a power of 2 near geometric mean of the limits.
+		unsigned avg_bits = (unsigned)std::floor(std::log2(std::sqrt((double)min_size_ * max_size_)));
+		avg_size_ = std::min(std::max(uint32_t(1) << avg_bits, min_size_), max_size_);
+
+		mask_small_ = top_bits_mask(avg_bits+1);	// Harder to cut before avg_size_
+		mask_large_ = top_bits_mask(avg_bits-1);	// Easier to cut after avg_size_
+	}
+
+	uint32_t min_size() const {return min_size_;}
+	uint32_t avg_size() const {return avg_size_;}
+	uint32_t max_size() const {return max_size_;}
+
+	/**
+	 * Finds the next cut point.
+	 * @param data beginning of the chunk
+	 * @param size bytes available. If less than max_size(), data must end at the end of the stream.
+	 * @return length of the chunk
+	 */
+	uint32_t cut(const uint8_t* data, size_t size) const {
+		if(size <= min_size_) return (uint32_t)size;
+		uint32_t limit = (uint32_t)std::min<size_t>(size, max_size_);
+		uint32_t normal = std::min(avg_size_, limit);
+
+		const auto& gear = gear_table();
+		uint64_t hash = 0;
+		uint32_t i = min_size_;
+		for(; i < normal; i++){
+			hash = (hash << 1) + gear[data[i]];
+			if(!(hash & mask_small_)) return i;
+		}
+		for(; i < limit; i++){
+			hash = (hash << 1) + gear[data[i]];
+			if(!(hash & mask_large_)) return i;
+		}
+		return limit;
+	}
+};
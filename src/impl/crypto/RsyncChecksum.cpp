@@ -0,0 +1,136 @@
+/* Copyright (C) 2014-2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "RsyncChecksum.h"
+
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__))
+#	define RSYNC_X86_DISPATCH 1
+#	include <immintrin.h>
+#	define RSYNC_TARGET(isa) __attribute__((target(isa)))
+#elif defined(_MSC_VER) && defined(_M_X64)
+#	define RSYNC_X86_DISPATCH 1
+#	include <intrin.h>
+#	include <immintrin.h>
+#	define RSYNC_TARGET(isa)
+#endif
+
+namespace {
+
+using sums_function = void (*)(const uint8_t*, size_t, uint32_t&, uint32_t&);
+
+/* Reference implementation. Also used for tails, which are shorter than a vector */
+void sums_scalar(const uint8_t* data, size_t size, uint32_t& s1, uint32_t& s2) {
+	for(size_t i = 0; i < size; i++){
+		s1 += data[i];
+		s2 += s1;
+	}
+}
+
+#ifdef RSYNC_X86_DISPATCH
+/*
+ * Vector kernels use the weighted prefix sum form of the recurrence. For a chunk x[0..N) appended to a state (s1, s2):
+ *   s2' = s2 + N*s1 + sum((N-j)*x[j])
+ *   s1' = s1 + sum(x[j])
+ * N*s1 terms are accumulated lane-wise and multiplied once in the end. All arithmetic wraps modulo 2^32, like the
+ * scalar version does.
+ */
+RSYNC_TARGET("sse2")
+uint32_t hsum_epi32(__m128i v) {
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+	v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+	return (uint32_t)_mm_cvtsi128_si32(v);
+}
+
+RSYNC_TARGET("sse2")
+void sums_sse2(const uint8_t* data, size_t size, uint32_t& s1, uint32_t& s2) {
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i weights_lo = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+	const __m128i weights_hi = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+
+	__m128i v_s1 = zero, v_prefix = zero, v_s2 = zero;
+
+	const size_t chunks = size / 16;
+	for(size_t i = 0; i < chunks; i++, data += 16){
+		__m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data));
+
+		v_prefix = _mm_add_epi32(v_prefix, v_s1);
+		v_s1 = _mm_add_epi32(v_s1, _mm_sad_epu8(x, zero));
+		v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpacklo_epi8(x, zero), weights_lo));
+		v_s2 = _mm_add_epi32(v_s2, _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), weights_hi));
+	}
+
+	s2 += uint32_t(chunks*16)*s1 + 16*hsum_epi32(v_prefix) + hsum_epi32(v_s2);
+	s1 += hsum_epi32(v_s1);
+
+	sums_scalar(data, size % 16, s1, s2);
+}
+
+#	if !defined(_MSC_VER) || defined(__AVX2__)
+RSYNC_TARGET("avx2")
+void sums_avx2(const uint8_t* data, size_t size, uint32_t& s1, uint32_t& s2) {
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256i ones = _mm256_set1_epi16(1);
+	const __m256i weights = _mm256_setr_epi8(
+			32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17,
+			16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+
+	__m256i v_s1 = zero, v_prefix = zero, v_s2 = zero;
+
+	const size_t chunks = size / 32;
+	for(size_t i = 0; i < chunks; i++, data += 32){
+		__m256i x = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data));
+
+		v_prefix = _mm256_add_epi32(v_prefix, v_s1);
+		v_s1 = _mm256_add_epi32(v_s1, _mm256_sad_epu8(x, zero));
+		v_s2 = _mm256_add_epi32(v_s2, _mm256_madd_epi16(_mm256_maddubs_epi16(x, weights), ones));
+	}
+
+	__m128i prefix = _mm_add_epi32(_mm256_castsi256_si128(v_prefix), _mm256_extracti128_si256(v_prefix, 1));
+	__m128i sum1 = _mm_add_epi32(_mm256_castsi256_si128(v_s1), _mm256_extracti128_si256(v_s1, 1));
+	__m128i sum2 = _mm_add_epi32(_mm256_castsi256_si128(v_s2), _mm256_extracti128_si256(v_s2, 1));
+
+	s2 += uint32_t(chunks*32)*s1 + 32*hsum_epi32(prefix) + hsum_epi32(sum2);
+	s1 += hsum_epi32(sum1);
+
+	sums_sse2(data, size % 32, s1, s2);
+}
+#	endif
+
+sums_function select_sums() {
+#	if defined(_MSC_VER)
+#		if defined(__AVX2__)
+	return sums_avx2;
+#		else
+	return sums_sse2;
+#		endif
+#	else
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) return sums_avx2;
+	if(__builtin_cpu_supports("sse2")) return sums_sse2;
+	return sums_scalar;
+#	endif
+}
+#else
+sums_function select_sums() {return sums_scalar;}
+#endif
+
+} /* namespace */
+
+void rsync_sums(const uint8_t* data, size_t size, uint32_t& s1, uint32_t& s2) {
+	static const sums_function selected_sums = select_sums();
+
+	s1 = 0; s2 = 0;
+	selected_sums(data, size, s1, s2);
+}
@@ -15,20 +15,43 @@
  */
 #pragma once
 
+#include <cstddef>
 #include <cstdint>
+#include <iterator>
 #include <string>
+#include <vector>
 
-using weakhash_t = uint32_t;
+using weakhash32_t = uint32_t;
+using weakhash64_t = uint64_t;
+using weakhash_t = weakhash64_t;	// Wide enough to hold a weak hash of any WeakHashType
+
+/**
+ * Computes raw sums without char_offset: s1 = sum(data[i]), s2 = sum((size-i)*data[i]), modulo 2^32.
+ * Dispatches to SSE2 or AVX2 kernel at runtime.
+ */
+void rsync_sums(const uint8_t* data, size_t size, uint32_t& s1, uint32_t& s2);
+
+/**
+ * Rolling checksum. WeakHashT selects the width: lower half of it is taken from s1, upper half from s2.
+ * With uint32_t it is the classic rsync checksum, with uint64_t both sums are kept in full 32 bits.
+ */
+template<class WeakHashT>
+class BasicRsyncChecksum {
+	static constexpr unsigned half_bits = sizeof(WeakHashT)*4;
+	static constexpr WeakHashT half_mask = (WeakHashT(1) << half_bits) - 1;
 
-class RsyncChecksum {
 	const uint8_t char_offset = 31;
 	uint_fast32_t count = 0;
 	uint_fast32_t s1 = 0, s2 = 0;
 public:
-	RsyncChecksum(){}
-	template<class InputIterator> RsyncChecksum(InputIterator first, InputIterator last) : RsyncChecksum(){compute(first, last);}
+	using weakhash_type = WeakHashT;
+
+	BasicRsyncChecksum(){}
+	template<class InputIterator> BasicRsyncChecksum(InputIterator first, InputIterator last) : BasicRsyncChecksum(){compute(first, last);}
+	BasicRsyncChecksum(const uint8_t* data, size_t size) : BasicRsyncChecksum(){compute(data, size);}
 
-	operator weakhash_t() const {return (s1 & 0xffff) | (s2 << 16);}
+	operator WeakHashT() const {return value();}
+	WeakHashT value() const {return (WeakHashT(s1) & half_mask) | (WeakHashT(s2) << half_bits);}
 
 	/**
 	 * Computation itself. Based on work of Donovan Baarda <abo@minkirri.apana.org.au>. Code modified from librsync.
@@ -36,19 +59,114 @@ public:
 	 * @param last
 	 * @return
 	 */
-	template<class InputIterator> weakhash_t compute(InputIterator first, InputIterator last){
+	template<class InputIterator> WeakHashT compute(InputIterator first, InputIterator last){
 		s1 = 0; s2 = 0;
 		count = std::distance(first, last);
 		for(auto it = first; it != last; it++){
 			s1 += (reinterpret_cast<const uint8_t&>(*it) + char_offset);
 			s2 += s1;
 		}
-		return static_cast<uint32_t>(*this);
+		return value();
+	}
+
+	/**
+	 * Same as compute(first, last), but for contiguous memory. Uses a vectorized kernel, if the CPU supports it.
+	 * Results are bit-identical to the iterator version, which serves as the reference implementation.
+	 * @param data
+	 * @param size
+	 * @return
+	 */
+	WeakHashT compute(const uint8_t* data, size_t size){
+		s1 = 0; s2 = 0; count = 0;
+		return update(data, size);
 	}
 
-	weakhash_t roll(uint8_t out, uint8_t in){
+	/**
+	 * Sets the checksum of a window from its raw sums, as returned by rsync_sums() or RsyncPrefixSums.
+	 * @param raw_s1
+	 * @param raw_s2
+	 * @param size
+	 * @return
+	 */
+	WeakHashT assign(uint32_t raw_s1, uint32_t raw_s2, size_t size){
+		s1 = 0; s2 = 0; count = 0;
+		return append_sums(raw_s1, raw_s2, size);
+	}
+
+	/**
+	 * Appends data to the checksummed window, so a block can be checksummed in pieces.
+	 * update(a) followed by update(b) gives the same result as compute(a+b).
+	 * @param data
+	 * @param size
+	 * @return
+	 */
+	WeakHashT update(const uint8_t* data, size_t size){
+		uint32_t raw_s1, raw_s2;
+		rsync_sums(data, size, raw_s1, raw_s2);
+		return append_sums(raw_s1, raw_s2, size);
+	}
+
+	WeakHashT roll(uint8_t out, uint8_t in){
 		s1 -= (out+char_offset); s1 += (in+char_offset);
 		s2 -= count*(out+char_offset); s2 += s1;
-		return static_cast<uint32_t>(*this);
+		return value();
+	}
+
+private:
+	WeakHashT append_sums(uint32_t raw_s1, uint32_t raw_s2, size_t size){
+		// Adding char_offset to every byte contributes size*char_offset to s1 and (size+1)*size/2*char_offset to s2.
+		// Every appended byte also adds the previous s1 to s2 once more.
+		uint_fast64_t triangle = (size % 2 == 0) ? uint_fast64_t(size/2)*(size+1) : uint_fast64_t(size)*((size+1)/2);
+		count += size;
+		s2 += uint_fast64_t(size)*s1 + raw_s2 + triangle*char_offset;
+		s1 += raw_s1 + uint_fast64_t(size)*char_offset;
+		return value();
+	}
+};
+
+using RsyncChecksum = BasicRsyncChecksum<weakhash32_t>;
+using RsyncChecksum64 = BasicRsyncChecksum<weakhash64_t>;
+
+/**
+ * Prefix sums of a sliding buffer, giving raw rsync sums of any window inside it in O(1). Windows of different sizes
+ * can be checksummed over one shared pass of the data, and jumping over a matched block needs no recomputation.
+ * Sums wrap modulo 2^32, just like the checksum itself.
+ *
+ * Costs 8 bytes (two 32-bit sums) for every byte of the buffer, on top of the buffer itself.
+ */
+class RsyncPrefixSums {
+public:
+	RsyncPrefixSums() : s1_(1, 0), weighted_(1, 0) {}
+
+	// Appends data, which follows the data appended before.
+	void append(const uint8_t* data, size_t size){
+		s1_.reserve(s1_.size()+size); weighted_.reserve(weighted_.size()+size);
+		uint32_t s1 = s1_.back(), weighted = weighted_.back();
+		uint32_t position = uint32_t(origin_+s1_.size()-1);
+		for(size_t i = 0; i < size; i++, position++){
+			s1 += data[i]; weighted += position*data[i];
+			s1_.push_back(s1); weighted_.push_back(weighted);
+		}
+	}
+
+	// Drops the first count bytes. Positions of windows are relative to the first byte kept.
+	void discard(size_t count){
+		s1_.erase(s1_.begin(), s1_.begin()+count);
+		weighted_.erase(weighted_.begin(), weighted_.begin()+count);
+		origin_ += count;
 	}
+
+	size_t size() const {return s1_.size()-1;}
+
+	// Same sums as rsync_sums() computes over size bytes, starting at pos.
+	void window_sums(size_t pos, size_t size, uint32_t& s1, uint32_t& s2) const {
+		s1 = s1_[pos+size] - s1_[pos];
+		// sum((size-i)*data[i]) == end*s1 - sum(position*data[position])
+		s2 = uint32_t(origin_+pos+size)*s1 - (weighted_[pos+size] - weighted_[pos]);
+	}
+
+private:
+	uint64_t origin_ = 0;	// Absolute position of the first byte kept
+	std::vector<uint32_t> s1_;	// s1_[i] = sum(data[j]) for j < i
+	std::vector<uint32_t> weighted_;	// weighted_[i] = sum(position(j)*data[j]) for j < i
 };
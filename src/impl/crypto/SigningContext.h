@@ -0,0 +1,59 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "StrongHasher.h"
+#include <cryptopp/osrng.h>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Per-thread state of block signing: RNG, hashers and the ciphertext buffer.
+ * Setting these up is expensive (RNG seeds itself from the OS), so it is done once per thread. Nothing here depends on
+ * the key: keyed ciphers belong to the map (see EncryptionPool), so key material doesn't outlive it in worker threads.
+ */
+class SigningContext {
+public:
+	static SigningContext& local() {
+		thread_local SigningContext context;
+		return context;
+	}
+
+	CryptoPP::RandomNumberGenerator& rng() {return rng_;}
+
+	StrongHasher& plaintext_hasher(StrongHashType type) {return hasher(plaintext_hasher_, type);}
+	StrongHasher& ciphertext_hasher(StrongHashType type) {return hasher(ciphertext_hasher_, type);}
+
+	// Scratch buffer for ciphertext, at least size bytes long
+	uint8_t* buffer(size_t size) {
+		if(buffer_.size() < size) buffer_.resize(size);
+		return buffer_.data();
+	}
+
+private:
+	CryptoPP::AutoSeededRandomPool rng_;
+
+	std::unique_ptr<StrongHasher> plaintext_hasher_, ciphertext_hasher_;
+	std::vector<uint8_t> buffer_;
+
+	static StrongHasher& hasher(std::unique_ptr<StrongHasher>& hasher, StrongHashType type) {
+		if(!hasher || hasher->type() != type) hasher.reset(new StrongHasher(type));
+		return *hasher;
+	}
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
@@ -0,0 +1,76 @@
+/* Copyright (C) 2014-2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "../../../include/cryptodiff.h"
+#include <cryptopp/blake2.h>
+#include <cryptopp/sha.h>
+#include <cryptopp/sha3.h>
+#include <array>
+#include <memory>
+#include <vector>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Incremental strong hash. Data can be fed in any number of pieces, so non-contiguous data (like a ring buffer) can be
+ * hashed in place. Hashes shorter than 28 bytes are zero-padded, longer ones are truncated.
+ *
+ * BLAKE2B_224 is sequential BLAKE2b, not a tree mode like BLAKE2bp: Crypto++ has none, and feeding pieces in order
+ * (tiles fused with encryption, windows while matching) needs a sequential hash. Blocks are hashed in parallel instead.
+ */
+class StrongHasher {
+public:
+	using hash_type = std::array<uint8_t, 28>;
+
+	StrongHasher(StrongHashType type) : type_(type) {
+		switch(type){
+			case SHA3_224: hash_.reset(new CryptoPP::SHA3_224()); break;
+			case SHA2_224: hash_.reset(new CryptoPP::SHA224()); break;
+			case BLAKE2B_224: hash_.reset(new CryptoPP::BLAKE2b(false, 28)); break;	// Unkeyed, 28-byte digest
+			default: throw error("Unknown strong hash type");
+		}
+	}
+
+	StrongHashType type() const {return type_;}
+
+	StrongHasher& update(const uint8_t* data, size_t size) {
+		hash_->Update(data, size);
+		return *this;
+	}
+
+	// Returns the hash and resets the hasher, so it can be reused.
+	hash_type final() {
+		hash_type hash = {};
+		hash_->TruncatedFinal(hash.data(), std::min<size_t>(hash.size(), hash_->DigestSize()));
+		return hash;
+	}
+
+	/* Hasher of this type, owned by the calling thread. Avoids constructing hash objects on hot paths. */
+	static StrongHasher& local(StrongHashType type) {
+		thread_local std::vector<std::unique_ptr<StrongHasher>> hashers;
+		if(hashers.size() <= type) hashers.resize(type+1);
+		if(!hashers[type]) hashers[type].reset(new StrongHasher(type));
+		return *hashers[type];
+	}
+
+private:
+	StrongHashType type_;
+	std::unique_ptr<CryptoPP::HashTransformation> hash_;
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
@@ -26,6 +26,7 @@
 
 // Crypto++
 #include <cryptopp/aes.h>
+#include <cryptopp/blake2.h>
 #include <cryptopp/ccm.h>
 #include <cryptopp/cryptlib.h>
 #include <cryptopp/eccrypto.h>
@@ -34,6 +35,7 @@
 #include <cryptopp/filters.h>
 #include <cryptopp/hex.h>
 #include <cryptopp/integer.h>
+#include <cryptopp/modes.h>
 #include <cryptopp/oids.h>
 #include <cryptopp/osrng.h>
 #include <cryptopp/sha3.h>
@@ -45,6 +47,7 @@
 #include <boost/asio.hpp>
 
 #include <boost/endian/arithmetic.hpp>
+#include <boost/endian/conversion.hpp>
 
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
@@ -76,6 +79,7 @@
 #include <memory>
 #include <queue>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <stdexcept>
 #include <string>
@@ -14,12 +14,19 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #pragma once
+#include "FlatMap.h"
 #include <cstdint>
+#include <iterator>
 #include <map>
+#include <stdexcept>
 
 namespace cryptodiff {
 
-template <typename OffsetT = uint64_t>
+/**
+ * Free space of a file, as sorted non-overlapping (offset, length) ranges. ContainerT is the backing store: FlatMap by
+ * default, or anything with the same subset of std::map interface (std::map itself, for one).
+ */
+template <typename OffsetT = uint64_t, class ContainerT = FlatMap<OffsetT, OffsetT>>
 class AvailabilityMap {
 public:
 	struct error : public std::runtime_error {
@@ -27,7 +34,7 @@ public:
 	};
 
 	using offset_type = OffsetT;
-	using underlying_container = std::map<offset_type, offset_type>;
+	using underlying_container = ContainerT;
 	using block_type = std::pair<offset_type, offset_type>;
 	using const_iterator = typename underlying_container::const_iterator;
 
@@ -68,22 +75,29 @@ public:
 
 		block_type block_left, block_right;
 		if(slice_superset(block, *space_it, block_left, block_right)) {
-			available_map_.erase(space_it);
+			// Remainders take the place of the sliced range, so no search is needed to insert them.
+			const_iterator next_it = available_map_.erase(space_it);
 			size_left_ -= block.second;
 
-			const_iterator right_it;
-
 			if(block_left != block_type(0,0))
-				available_map_.insert(block_left);
+				next_it = std::next(available_map_.emplace_hint(next_it, block_left));
 			if(block_right != block_type(0,0))
-				right_it = available_map_.insert(block_right).first;
-			else
-				right_it = available_map_.upper_bound(block.first);
+				next_it = available_map_.emplace_hint(next_it, block_right);
 
-			return {right_it, true};
+			return {next_it, true};
 		} else return {end(), false};
 	};
 
+	/* Free ranges, that overlap [offset, offset+length) */
+	std::pair<const_iterator, const_iterator> find_range(offset_type offset, offset_type length) {
+		const_iterator first = available_map_.upper_bound(offset);
+		if(first != available_map_.cbegin() && std::prev(first)->first+std::prev(first)->second > offset) --first;
+		const_iterator last = available_map_.lower_bound(offset+length);
+		return {first, last};
+	}
+
+	size_t ranges() const {return available_map_.size();}
+
 	const_iterator begin() {return available_map_.cbegin();}
 	const_iterator end() {return available_map_.cend();}
 
@@ -0,0 +1,178 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+#include <boost/noncopyable.hpp>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Fixed memory budget for data buffers. Buffers are recycled: a returned buffer is kept for the next request, as long
+ * as it fits in the budget together with buffers in use. Requests wait until enough of the budget is free, which gives
+ * backpressure to producers of data. A request larger than the whole budget is granted when nothing else is in use.
+ *
+ * Memory allocated elsewhere (like scanning and read-ahead buffers) can be accounted with a Reservation. A buffer is
+ * also granted when only reservations are in use, so a thread holding a reservation for its read-ahead can always make
+ * progress. A reservation, unlike a buffer, waits for those: a thread should take a single one for all of its memory.
+ *
+ * To avoid deadlocks, a thread must not wait for the pool while holding buffers, that only it can return.
+ */
+class BufferPool : boost::noncopyable {
+public:
+	using buffer_type = std::vector<uint8_t>;
+
+	// Buffer from the pool, or a plain one, if constructed from data. Returned to its pool on destruction.
+	class Buffer {
+	public:
+		Buffer() {}
+		Buffer(buffer_type data) : data_(std::move(data)) {}
+		Buffer(Buffer&& buffer) {*this = std::move(buffer);}
+		Buffer& operator=(Buffer&& buffer) {
+			release();
+			data_ = std::move(buffer.data_); pool_ = buffer.pool_; accounted_ = buffer.accounted_;
+			buffer.pool_ = nullptr; buffer.accounted_ = 0;
+			return *this;
+		}
+		~Buffer() {release();}
+
+		buffer_type& operator*() {return data_;}
+		buffer_type* operator->() {return &data_;}
+		const buffer_type& operator*() const {return data_;}
+		const buffer_type* operator->() const {return &data_;}
+
+		void release() {
+			if(pool_) pool_->put_back(std::move(data_), accounted_);
+			pool_ = nullptr; accounted_ = 0;
+			data_ = buffer_type();
+		}
+
+	private:
+		friend class BufferPool;
+		buffer_type data_;
+		BufferPool* pool_ = nullptr;
+		size_t accounted_ = 0;
+	};
+
+	// Part of the budget, used by memory outside of the pool. Returned on destruction.
+	class Reservation : boost::noncopyable {
+	public:
+		Reservation(BufferPool* pool, size_t bytes) : pool_(pool), bytes_(bytes) {
+			if(pool_) pool_->take(bytes_);
+		}
+		~Reservation() {
+			if(pool_) pool_->give(bytes_);
+		}
+	private:
+		BufferPool* pool_;
+		size_t bytes_;
+	};
+
+	BufferPool(uint64_t limit) : limit_(limit) {}
+
+	uint64_t limit() const {return limit_;}
+
+	// Buffer of size bytes. Waits, until it fits in the budget.
+	Buffer acquire(size_t size) {
+		std::unique_lock<std::mutex> lk(mutex_);
+		cv_.wait(lk, [&]{return fits(size);});
+		return make_buffer(size);
+	}
+	// Same, but returns false instead of waiting
+	bool try_acquire(size_t size, Buffer& buffer) {
+		std::unique_lock<std::mutex> lk(mutex_);
+		if(!fits(size)) return false;
+		Buffer acquired = make_buffer(size);
+		lk.unlock();	// Assignment releases the old buffer, which locks the pool
+		buffer = std::move(acquired);
+		return true;
+	}
+
+private:
+	const uint64_t limit_;
+
+	std::mutex mutex_;
+	std::condition_variable cv_;
+	uint64_t in_use_ = 0;
+	uint64_t reserved_ = 0;	// Part of in_use_, taken by reservations
+	std::vector<buffer_type> free_;
+	uint64_t free_bytes_ = 0;
+
+	bool fits(uint64_t size) const {return in_use_ == reserved_ || in_use_+size <= limit_;}
+
+	// Drops free buffers, until size more bytes fit in the budget
+	void trim(uint64_t size) {
+		while(!free_.empty() && in_use_+free_bytes_+size > limit_){
+			free_bytes_ -= free_.back().capacity();
+			free_.pop_back();
+		}
+	}
+
+	Buffer make_buffer(size_t size) {
+		Buffer buffer;
+		// Recycled buffer is charged with its capacity, so it is taken only if that fits too
+		auto free_it = std::find_if(free_.begin(), free_.end(), [&](const buffer_type& data){
+			return data.capacity() >= size && fits(data.capacity());
+		});
+		if(free_it != free_.end()){
+			buffer.data_ = std::move(*free_it);
+			free_.erase(free_it);
+			free_bytes_ -= buffer.data_.capacity();
+		}else{
+			trim(size);
+			buffer.data_.reserve(size);
+		}
+		buffer.data_.resize(size);
+		buffer.pool_ = this;
+		buffer.accounted_ = buffer.data_.capacity();
+		in_use_ += buffer.accounted_;
+		return buffer;
+	}
+
+	void take(size_t bytes) {
+		std::unique_lock<std::mutex> lk(mutex_);
+		cv_.wait(lk, [&]{return in_use_ == 0 || in_use_+bytes <= limit_;});
+		trim(bytes);
+		in_use_ += bytes;
+		reserved_ += bytes;
+	}
+
+	void give(size_t bytes) {
+		std::unique_lock<std::mutex> lk(mutex_);
+		in_use_ -= bytes;
+		reserved_ -= bytes;
+		lk.unlock();
+		cv_.notify_all();
+	}
+
+	void put_back(buffer_type data, size_t accounted) {
+		std::unique_lock<std::mutex> lk(mutex_);
+		in_use_ -= accounted;
+		if(data.capacity() != 0 && in_use_+free_bytes_+data.capacity() <= limit_){
+			free_bytes_ += data.capacity();
+			free_.push_back(std::move(data));
+		}
+		lk.unlock();
+		cv_.notify_all();
+	}
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
@@ -0,0 +1,67 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <memory>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Value of type T, shared between copies until one of them is modified. Copying is O(1), write() copies the whole
+ * value only if it is still shared. An empty value is created only when it is written, so default construction and
+ * moves don't allocate.
+ */
+template<class T>
+class CopyOnWrite {
+public:
+	CopyOnWrite() noexcept {}
+	CopyOnWrite(const CopyOnWrite&) = default;
+	CopyOnWrite& operator=(const CopyOnWrite&) = default;
+	// Moved-from object holds an empty value, so it stays usable
+	CopyOnWrite(CopyOnWrite&& other) noexcept : value_(std::move(other.value_)) {}
+	CopyOnWrite& operator=(CopyOnWrite&& other) noexcept {
+		if(this != &other) value_ = std::move(other.value_);
+		return *this;
+	}
+
+	const T& operator*() const {return value_ ? *value_ : empty();}
+	const T* operator->() const {return &**this;}
+
+	T& write() {
+		if(!value_)
+			value_ = std::make_shared<T>();
+		else if(value_.use_count() > 1)
+			value_ = std::make_shared<T>(*value_);
+		return *value_;
+	}
+
+	// Replaces the value with a new, default-constructed one, without copying the old one.
+	T& reset() {
+		value_ = std::make_shared<T>();
+		return *value_;
+	}
+
+private:
+	std::shared_ptr<T> value_;	// nullptr means empty value
+
+	static const T& empty() {
+		static const T empty_value;
+		return empty_value;
+	}
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
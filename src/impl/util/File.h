@@ -14,52 +14,49 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 #pragma once
-#include <cstdint>
-#include <string>
-#include <vector>
-#include <iostream>
-#include <fstream>
-#include <mutex>
-#include <boost/noncopyable.hpp>
+#include "FileBackend.h"
+#include "IoUringFileBackend.h"
+#include <memory>
 
 namespace cryptodiff {
 namespace internals {
 
 class File : boost::noncopyable {
 public:
-	File(const std::string& path) : path_(path) {
-		ifs_.exceptions(std::ios::failbit | std::ios::badbit);
-		ifs_.open(path, std::ios_base::in | std::ios_base::binary);
-	}
-	virtual ~File() {}
-
-	uint64_t size() {
-		std::lock_guard<std::mutex> lk(mutex_);
+	using ReadRequest = FileBackend::ReadRequest;
 
-		ifs_.seekg(0, ifs_.end);
-		auto size = ifs_.tellg();
+	static constexpr uint32_t sequential_read_size = 4*1024*1024;	// Reads of passes over the whole file, or a part of it
 
-		return size;
+	File(const std::string& path) : path_(path), backend_(open_backend(path)) {
+		size_ = backend_->size();
 	}
-	std::vector<uint8_t> get(uint64_t offset, uint32_t size) {
-		std::lock_guard<std::mutex> lk(mutex_);
+	virtual ~File() {}
 
-		std::vector<uint8_t> rdbuf(size);
-		ifs_.seekg(offset);
-		ifs_.read(reinterpret_cast<char*>(rdbuf.data()), size);
+	uint64_t size() const {return size_;}
 
-		return rdbuf;
+	void read(uint64_t offset, uint32_t size, uint8_t* dest) {
+		backend_->read(offset, size, dest);
+	}
+	// Reads many blocks at once, so the backend can keep them in flight together.
+	void read_batch(const std::vector<ReadRequest>& requests) {
+		backend_->read_batch(requests);
 	}
-	uint8_t get(uint64_t offset) {
-		std::lock_guard<std::mutex> lk(mutex_);
-		ifs_.seekg(offset); // FIXME: major performance issue, slow seekg.
 
-		return ifs_.get();
+	// Best backend, available on this platform: io_uring (if built with it), pread, or std::ifstream.
+	static std::unique_ptr<FileBackend> open_backend(const std::string& path) {
+#if defined(CRYPTODIFF_WITH_IO_URING)
+		return std::unique_ptr<FileBackend>(new IoUringFileBackend(path));
+#elif defined(CRYPTODIFF_HAVE_PREAD)
+		return std::unique_ptr<FileBackend>(new PreadFileBackend(path));
+#else
+		return std::unique_ptr<FileBackend>(new StreamFileBackend(path));
+#endif
 	}
+
 private:
 	const std::string path_;
-	std::ifstream ifs_;
-	std::mutex mutex_;
+	std::unique_ptr<FileBackend> backend_;
+	uint64_t size_;
 };
 
 } /* namespace internals */
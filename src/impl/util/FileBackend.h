@@ -0,0 +1,124 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <mutex>
+#include <system_error>
+#include <boost/noncopyable.hpp>
+
+#if defined(__unix__) || (defined(__APPLE__) && defined(__MACH__))
+#	define CRYPTODIFF_HAVE_PREAD
+#	include <cerrno>
+#	include <fcntl.h>
+#	include <sys/stat.h>
+#	include <unistd.h>
+#endif
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Positional reads from an opened file. Implementations must allow concurrent calls from different threads.
+ * Reads past the end of file throw std::ios_base::failure, other I/O errors throw std::system_error.
+ */
+class FileBackend : boost::noncopyable {
+public:
+	struct ReadRequest {
+		uint64_t offset;
+		uint32_t size;
+		uint8_t* dest;
+	};
+
+	virtual ~FileBackend() {}
+
+	virtual uint64_t size() const = 0;
+	virtual void read(uint64_t offset, uint32_t size, uint8_t* dest) = 0;
+	// Completes all requests. Asynchronous backends keep them in flight together, instead of one by one.
+	virtual void read_batch(const std::vector<ReadRequest>& requests) {
+		for(auto& request : requests) read(request.offset, request.size, request.dest);
+	}
+};
+
+/* Portable fallback. One stream, so reads are serialized on a mutex. */
+class StreamFileBackend : public FileBackend {
+public:
+	StreamFileBackend(const std::string& path) {
+		ifs_.exceptions(std::ios::failbit | std::ios::badbit);
+		ifs_.open(path, std::ios_base::in | std::ios_base::binary);
+
+		ifs_.seekg(0, ifs_.end);
+		size_ = ifs_.tellg();
+	}
+
+	virtual uint64_t size() const {return size_;}
+	virtual void read(uint64_t offset, uint32_t size, uint8_t* dest) {
+		std::lock_guard<std::mutex> lk(mutex_);
+
+		ifs_.clear();	// Reads past the end, which threw, leave eofbit and failbit set
+		ifs_.seekg(offset);
+		ifs_.read(reinterpret_cast<char*>(dest), size);
+	}
+
+private:
+	std::ifstream ifs_;
+	std::mutex mutex_;
+	uint64_t size_;
+};
+
+#ifdef CRYPTODIFF_HAVE_PREAD
+/* pread(2) on a shared descriptor. Does not move any file position, so concurrent reads need no locking. */
+class PreadFileBackend : public FileBackend {
+public:
+	PreadFileBackend(const std::string& path) {
+		fd_ = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if(fd_ < 0) throw std::system_error(errno, std::system_category(), "Could not open " + path);
+
+		struct stat st;
+		if(::fstat(fd_, &st) < 0) {
+			int fstat_errno = errno;
+			::close(fd_);
+			throw std::system_error(fstat_errno, std::system_category(), "Could not stat " + path);
+		}
+		size_ = (uint64_t)st.st_size;
+	}
+	virtual ~PreadFileBackend() {::close(fd_);}
+
+	virtual uint64_t size() const {return size_;}
+	virtual void read(uint64_t offset, uint32_t size, uint8_t* dest) {
+		while(size > 0) {
+			ssize_t bytes_read = ::pread(fd_, dest, size, (off_t)offset);
+			if(bytes_read < 0) {
+				if(errno == EINTR) continue;
+				throw std::system_error(errno, std::system_category(), "Could not read file");
+			}
+			if(bytes_read == 0) throw std::ios_base::failure("Unexpected end of file");
+
+			offset += bytes_read; size -= (uint32_t)bytes_read; dest += bytes_read;
+		}
+	}
+
+protected:
+	int fd_;
+	uint64_t size_;
+};
+#endif
+
+} /* namespace internals */
+} /* namespace cryptodiff */
@@ -0,0 +1,76 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+namespace cryptodiff {
+
+/**
+ * Sorted vector with the subset of std::map interface, used by AvailabilityMap. Elements are contiguous and allocated
+ * in bulk. Insertion moves the elements after it, so it is cheap when insertions go in key order, like matched blocks do.
+ * Any insertion or erasure invalidates iterators.
+ */
+template<class Key, class T>
+class FlatMap {
+public:
+	using key_type = Key;
+	using mapped_type = T;
+	using value_type = std::pair<Key, T>;
+	using container_type = std::vector<value_type>;
+	using iterator = typename container_type::iterator;
+	using const_iterator = typename container_type::const_iterator;
+
+	iterator begin() {return values_.begin();}
+	iterator end() {return values_.end();}
+	const_iterator begin() const {return values_.begin();}
+	const_iterator end() const {return values_.end();}
+	const_iterator cbegin() const {return values_.cbegin();}
+	const_iterator cend() const {return values_.cend();}
+
+	size_t size() const {return values_.size();}
+	bool empty() const {return values_.empty();}
+	void reserve(size_t count) {values_.reserve(count);}
+	void clear() {values_.clear();}
+
+	iterator lower_bound(const Key& key) {
+		return std::lower_bound(values_.begin(), values_.end(), key, [](const value_type& value, const Key& key){return value.first < key;});
+	}
+	iterator upper_bound(const Key& key) {
+		return std::upper_bound(values_.begin(), values_.end(), key, [](const Key& key, const value_type& value){return key < value.first;});
+	}
+
+	std::pair<iterator, bool> insert(const value_type& value) {
+		auto it = lower_bound(value.first);
+		if(it != values_.end() && it->first == value.first) return {it, false};
+		return {values_.insert(it, value), true};
+	}
+
+	// O(1) search, if value belongs right before hint.
+	iterator emplace_hint(const_iterator hint, const value_type& value) {
+		bool hint_valid = (hint == values_.cbegin() || std::prev(hint)->first < value.first) && (hint == values_.cend() || value.first < hint->first);
+		if(!hint_valid) return insert(value).first;
+		return values_.insert(hint, value);
+	}
+
+	iterator erase(const_iterator it) {return values_.erase(it);}
+
+private:
+	container_type values_;
+};
+
+} /* namespace cryptodiff */
@@ -0,0 +1,274 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "IoUringFileBackend.h"
+
+#ifdef CRYPTODIFF_WITH_IO_URING
+#include <algorithm>
+#include <cstring>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+namespace cryptodiff {
+namespace internals {
+
+/* Minimal io_uring, with raw system calls. Ring memory is shared with the kernel, so indices are accessed atomically. */
+class IoUringFileBackend::Ring : boost::noncopyable {
+public:
+	Ring(unsigned entries, int file_fd) {
+		io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		fd_ = (int)::syscall(__NR_io_uring_setup, entries, &params);
+		if(fd_ < 0) throw std::system_error(errno, std::system_category(), "io_uring_setup");
+
+		try {
+			map_rings(params);
+			check_read_support();
+			// Registered file avoids taking a reference to the file on every read
+			if(::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_FILES, &file_fd, 1) < 0)
+				throw std::system_error(errno, std::system_category(), "io_uring_register");
+		}catch(...) {
+			release();
+			throw;
+		}
+	}
+	~Ring() {release();}
+
+	unsigned entries() const {return sq_entries_;}
+
+	// Places a read of the registered file into the submission queue. Queue must have a free entry.
+	void prepare_read(uint64_t offset, uint32_t size, uint8_t* dest, uint64_t user_data) {
+		unsigned tail = *sq_tail_;	// Only we write the tail
+		unsigned index = tail & sq_mask_;
+
+		io_uring_sqe& sqe = sqes_[index];
+		std::memset(&sqe, 0, sizeof(sqe));
+		sqe.opcode = IORING_OP_READ;
+		sqe.flags = IOSQE_FIXED_FILE;
+		sqe.fd = 0;	// Index of the registered file
+		sqe.off = offset;
+		sqe.addr = (uint64_t)(uintptr_t)dest;
+		sqe.len = size;
+		sqe.user_data = user_data;
+
+		sq_array_[index] = index;
+		__atomic_store_n(sq_tail_, tail+1, __ATOMIC_RELEASE);
+	}
+
+	// Withdraws the last count prepared entries, which were not submitted. The kernel takes entries only on enter().
+	void withdraw(unsigned count) {
+		__atomic_store_n(sq_tail_, *sq_tail_-count, __ATOMIC_RELEASE);
+	}
+
+	// Submits to_submit prepared entries and waits for at least min_complete completions. Returns number submitted,
+	// or -errno. Entries, that were submitted before an error, are in flight, so the caller must still reap them.
+	int enter(unsigned to_submit, unsigned min_complete) {
+		int submitted = (int)::syscall(__NR_io_uring_enter, fd_, to_submit, min_complete, min_complete ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+		return submitted >= 0 ? submitted : -errno;
+	}
+
+	// Calls handler(user_data, res) for every completion, that is ready
+	template<class Handler>
+	void reap(Handler handler) {
+		unsigned head = *cq_head_;	// Only we write the head
+		unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+		for(; head != tail; head++) {
+			const io_uring_cqe& cqe = cqes_[head & cq_mask_];
+			handler(cqe.user_data, cqe.res);
+		}
+		__atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+	}
+
+private:
+	int fd_ = -1;
+
+	void* sq_ring_ = MAP_FAILED; size_t sq_ring_size_ = 0;
+	void* cq_ring_ = MAP_FAILED; size_t cq_ring_size_ = 0;
+	io_uring_sqe* sqes_ = (io_uring_sqe*)MAP_FAILED; size_t sqes_size_ = 0;
+
+	unsigned* sq_head_; unsigned* sq_tail_; unsigned sq_mask_; unsigned sq_entries_; unsigned* sq_array_;
+	unsigned* cq_head_; unsigned* cq_tail_; unsigned cq_mask_; io_uring_cqe* cqes_;
+
+	void* map(size_t size, off_t offset) {
+		void* ptr = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd_, offset);
+		if(ptr == MAP_FAILED) throw std::system_error(errno, std::system_category(), "io_uring mmap");
+		return ptr;
+	}
+
+	void map_rings(const io_uring_params& params) {
+		sq_ring_size_ = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+		cq_ring_size_ = params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe);
+		if(params.features & IORING_FEAT_SINGLE_MMAP)
+			sq_ring_size_ = cq_ring_size_ = std::max(sq_ring_size_, cq_ring_size_);
+
+		sq_ring_ = map(sq_ring_size_, IORING_OFF_SQ_RING);
+		cq_ring_ = (params.features & IORING_FEAT_SINGLE_MMAP) ? sq_ring_ : map(cq_ring_size_, IORING_OFF_CQ_RING);
+		sqes_size_ = params.sq_entries*sizeof(io_uring_sqe);
+		sqes_ = (io_uring_sqe*)map(sqes_size_, IORING_OFF_SQES);
+
+		uint8_t* sq = (uint8_t*)sq_ring_;
+		sq_head_ = (unsigned*)(sq+params.sq_off.head);
+		sq_tail_ = (unsigned*)(sq+params.sq_off.tail);
+		sq_mask_ = *(unsigned*)(sq+params.sq_off.ring_mask);
+		sq_entries_ = *(unsigned*)(sq+params.sq_off.ring_entries);
+		sq_array_ = (unsigned*)(sq+params.sq_off.array);
+
+		uint8_t* cq = (uint8_t*)cq_ring_;
+		cq_head_ = (unsigned*)(cq+params.cq_off.head);
+		cq_tail_ = (unsigned*)(cq+params.cq_off.tail);
+		cq_mask_ = *(unsigned*)(cq+params.cq_off.ring_mask);
+		cqes_ = (io_uring_cqe*)(cq+params.cq_off.cqes);
+	}
+
+	void check_read_support() {
+		const unsigned probe_ops = 256;
+		std::vector<uint8_t> probe_buffer(sizeof(io_uring_probe) + probe_ops*sizeof(io_uring_probe_op));
+		io_uring_probe* probe = (io_uring_probe*)probe_buffer.data();
+
+		if(::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE, probe, probe_ops) < 0)
+			throw std::system_error(errno, std::system_category(), "io_uring probe");
+		if(probe->last_op < IORING_OP_READ || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+			throw std::system_error(ENOSYS, std::system_category(), "io_uring doesn't support IORING_OP_READ");
+	}
+
+	void release() {
+		if(sqes_ != MAP_FAILED) ::munmap(sqes_, sqes_size_);
+		if(cq_ring_ != MAP_FAILED && cq_ring_ != sq_ring_) ::munmap(cq_ring_, cq_ring_size_);
+		if(sq_ring_ != MAP_FAILED) ::munmap(sq_ring_, sq_ring_size_);
+		if(fd_ >= 0) ::close(fd_);
+	}
+};
+
+constexpr uint32_t IoUringFileBackend::max_piece_size;
+
+IoUringFileBackend::IoUringFileBackend(const std::string& path, unsigned queue_depth) :
+	PreadFileBackend(path), queue_depth_(queue_depth) {}
+
+IoUringFileBackend::~IoUringFileBackend() {}
+
+void IoUringFileBackend::read(uint64_t offset, uint32_t size, uint8_t* dest) {
+	if(size > max_piece_size)
+		read_batch({{offset, size, dest}});	// Split into pieces, that are in flight together
+	else
+		PreadFileBackend::read(offset, size, dest);
+}
+
+std::unique_ptr<IoUringFileBackend::Ring> IoUringFileBackend::acquire_ring() {
+	std::unique_lock<std::mutex> lk(rings_mutex_);
+	if(!free_rings_.empty()) {
+		std::unique_ptr<Ring> ring = std::move(free_rings_.back());
+		free_rings_.pop_back();
+		return ring;
+	}
+	if(ring_unavailable_) return nullptr;
+	lk.unlock();
+
+	try {
+		return std::unique_ptr<Ring>(new Ring(queue_depth_, fd_));
+	}catch(const std::system_error&) {
+		lk.lock();
+		ring_unavailable_ = true;
+		return nullptr;
+	}
+}
+
+void IoUringFileBackend::release_ring(std::unique_ptr<Ring> ring) {
+	std::lock_guard<std::mutex> lk(rings_mutex_);
+	free_rings_.push_back(std::move(ring));
+}
+
+void IoUringFileBackend::read_batch(const std::vector<ReadRequest>& batch) {
+	std::unique_ptr<Ring> ring = acquire_ring();
+	if(!ring) {
+		PreadFileBackend::read_batch(batch);
+		return;
+	}
+
+	// Large requests are split, so a few of them still fill the queue
+	std::vector<ReadRequest> requests;
+	requests.reserve(batch.size());
+	for(auto& request : batch)
+		for(uint32_t piece_offset = 0; piece_offset < request.size; piece_offset += max_piece_size)
+			requests.push_back({request.offset+piece_offset, std::min(request.size-piece_offset, max_piece_size), request.dest+piece_offset});
+
+	// Bytes of each request read so far. Short reads are resubmitted for the rest of the request.
+	std::vector<uint32_t> done(requests.size(), 0);
+	std::vector<size_t> resubmit; resubmit.reserve(requests.size());	// Never reallocates while reads are in flight
+	size_t next = 0;
+	unsigned prepared = 0;	// In the submission queue, not taken by the kernel yet
+	unsigned inflight = 0;
+
+	// Requests, that are in flight, must complete before returning, as the kernel writes into their buffers.
+	int error = 0;
+	bool eof = false;
+	bool broken = false;	// In-flight reads couldn't be waited for, so the ring can't be reused
+
+	while(inflight > 0 || prepared > 0 || (!error && !eof && (next < requests.size() || !resubmit.empty()))) {
+		while(!error && !eof && inflight+prepared < ring->entries() && (next < requests.size() || !resubmit.empty())) {
+			size_t n;
+			if(!resubmit.empty()) {
+				n = resubmit.back(); resubmit.pop_back();
+			}else
+				n = next++;
+
+			const ReadRequest& request = requests[n];
+			ring->prepare_read(request.offset+done[n], request.size-done[n], request.dest+done[n], n);
+			prepared++;
+		}
+		if((error || eof) && prepared > 0) {	// Nothing more is submitted, only in-flight reads are waited for
+			ring->withdraw(prepared);
+			prepared = 0;
+			if(inflight == 0) break;
+		}
+
+		// Submits and waits for a completion in the same call
+		int entered = ring->enter(prepared, 1);
+		if(entered >= 0) {
+			prepared -= (unsigned)entered; inflight += (unsigned)entered;
+		}else if(entered != -EINTR && entered != -EAGAIN && entered != -EBUSY) {	// Those are retried
+			if(prepared == 0) {
+				// Even waiting fails. Reads in flight are left to the kernel, which cancels them when the ring is closed.
+				error = -entered; broken = true;
+				break;
+			}
+			if(!error) error = -entered;
+		}
+
+		ring->reap([&](uint64_t n, int32_t res) {
+			inflight--;
+			if(res < 0) {
+				if(res == -EINTR || res == -EAGAIN)
+					resubmit.push_back((size_t)n);
+				else if(!error)
+					error = -res;
+			}else if(res == 0)
+				eof = true;
+			else {
+				done[n] += (uint32_t)res;
+				if(done[n] < requests[n].size) resubmit.push_back((size_t)n);
+			}
+		});
+	}
+
+	if(!broken) release_ring(std::move(ring));
+
+	if(error) throw std::system_error(error, std::system_category(), "Could not read file");
+	if(eof) throw std::ios_base::failure("Unexpected end of file");
+}
+
+} /* namespace internals */
+} /* namespace cryptodiff */
+#endif
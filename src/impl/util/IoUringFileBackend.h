@@ -0,0 +1,62 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include "FileBackend.h"
+
+#ifdef CRYPTODIFF_WITH_IO_URING
+#include <memory>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Linux io_uring backend. Batches are submitted to a ring with the file descriptor registered in it, keeping up to
+ * queue_depth reads in flight, so fast devices get a deep queue instead of one synchronous read at a time. Requests
+ * are split into pieces of at most max_piece_size, so a single large read (like a File::sequential_read_size pass over
+ * the file) is also in flight as many pieces.
+ *
+ * A ring has a single submitter, so every thread reading a batch takes its own ring from a pool: concurrent readers
+ * (like parallel segment scans) don't wait for each other. Rings are set up when needed, and kept for later batches.
+ * Small single reads, and batches on kernels where the ring can't be set up (older than 5.6, or io_uring disabled by
+ * seccomp or sysctl), use pread(2).
+ */
+class IoUringFileBackend : public PreadFileBackend {
+public:
+	static constexpr unsigned default_queue_depth = 64;
+	static constexpr uint32_t max_piece_size = 128*1024;
+
+	IoUringFileBackend(const std::string& path, unsigned queue_depth = default_queue_depth);
+	virtual ~IoUringFileBackend();
+
+	virtual void read(uint64_t offset, uint32_t size, uint8_t* dest);
+	virtual void read_batch(const std::vector<ReadRequest>& batch);
+
+private:
+	class Ring;
+	const unsigned queue_depth_;
+
+	std::vector<std::unique_ptr<Ring>> free_rings_;
+	bool ring_unavailable_ = false;
+	std::mutex rings_mutex_;
+
+	// Free ring, or a new one. nullptr, if io_uring is not available.
+	std::unique_ptr<Ring> acquire_ring();
+	void release_ring(std::unique_ptr<Ring> ring);
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
+#endif
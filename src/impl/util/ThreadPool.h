@@ -0,0 +1,63 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <boost/asio/io_service.hpp>
+#include <boost/noncopyable.hpp>
+#include <future>
+#include <memory>
+#include <thread>
+#include <vector>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Persistent pool of worker threads, running a shared io_service. Tasks must not block waiting for other tasks of the
+ * same pool.
+ */
+class ThreadPool : boost::noncopyable {
+public:
+	ThreadPool(unsigned threads) : work_(new boost::asio::io_service::work(io_service_)) {
+		threads = std::max(threads, 1u);
+		for(unsigned i = 0; i < threads; i++)
+			threads_.emplace_back([this]{io_service_.run();});
+	}
+	~ThreadPool() {
+		work_.reset();	// Lets already posted tasks finish.
+		for(auto& thread : threads_)
+			thread.join();
+	}
+
+	template<class Function>
+	std::future<typename std::result_of<Function()>::type> post(Function f) {
+		auto task = std::make_shared<std::packaged_task<typename std::result_of<Function()>::type()>>(std::move(f));
+		auto future = task->get_future();
+		io_service_.post([task]{(*task)();});
+		return future;
+	}
+
+	unsigned size() const {return (unsigned)threads_.size();}
+
+	static unsigned default_size() {return std::max(std::thread::hardware_concurrency(), 1u);}
+
+private:
+	boost::asio::io_service io_service_;
+	std::unique_ptr<boost::asio::io_service::work> work_;
+	std::vector<std::thread> threads_;
+};
+
+} /* namespace internals */
+} /* namespace cryptodiff */
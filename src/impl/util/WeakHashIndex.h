@@ -0,0 +1,156 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace cryptodiff {
+namespace internals {
+
+/**
+ * Flat multimap from weak hash to values, using open addressing with linear probing. Slots store the weak hash next to
+ * the value number, so a lookup miss usually costs a single cache line. Values are stored densely and numbered in
+ * insertion order; the numbers can be used to index external per-value state, like bitmaps of consumed blocks.
+ *
+ * Lookups are prefiltered by a blocked Bloom filter (two bits in one 64-bit word per key), sized to stay within L2.
+ * Most lookups during rolling are misses, and they usually end on a single bit test.
+ */
+template<class ValueT>
+class WeakHashIndex {
+public:
+	static constexpr size_t npos = size_t(-1);
+
+	void clear() {
+		slots_.clear(); keys_.clear(); values_.clear();
+		mask_ = 0;
+		filter_.clear(); filter_mask_ = 0;
+	}
+
+	void reserve(size_t count) {
+		keys_.reserve(count); values_.reserve(count);
+		if(count*2 > slots_.size()) rehash(count*2);
+	}
+
+	// Replaces contents with keys[n] -> values[n] pairs. Slots and filter are built once, for the final size.
+	void assign(std::vector<uint64_t> keys, std::vector<ValueT> values) {
+		keys_ = std::move(keys); values_ = std::move(values);
+		rehash(keys_.size()*2);
+	}
+
+	void insert(uint64_t key, ValueT value) {
+		if((keys_.size()+1)*2 > slots_.size()) rehash((keys_.size()+1)*2);
+
+		keys_.push_back(key);
+		values_.push_back(std::move(value));
+		place(key, (uint32_t)keys_.size());
+	}
+
+	bool may_contain(uint64_t key) const {
+		if(filter_.empty()) return false;
+		uint64_t h = filter_hash(key);
+		uint64_t bits = filter_bits(h);
+		return (filter_[h & filter_mask_] & bits) == bits;
+	}
+
+	/**
+	 * Calls pred(n) for every value number n with this key, until it returns true.
+	 * @return value number, for which pred returned true, or npos
+	 */
+	template<class Predicate>
+	size_t find_if(uint64_t key, Predicate pred) const {
+		if(!may_contain(key)) return npos;
+		for(size_t slot = slot_of(key); slots_[slot].number != 0; slot = (slot+1) & mask_){
+			if(slots_[slot].key == key && pred(size_t(slots_[slot].number-1)))
+				return slots_[slot].number-1;
+		}
+		return npos;
+	}
+
+	bool contains(uint64_t key) const {
+		return find_if(key, [](size_t){return true;}) != npos;
+	}
+
+	size_t size() const {return values_.size();}
+	bool empty() const {return values_.empty();}
+	uint64_t key(size_t n) const {return keys_[n];}
+	const ValueT& operator[](size_t n) const {return values_[n];}
+
+private:
+	struct Slot {
+		uint64_t key;
+		uint32_t number;	// Value number + 1. 0 means empty slot.
+	};
+	std::vector<Slot> slots_;
+	size_t mask_ = 0;
+
+	std::vector<uint64_t> keys_;
+	std::vector<ValueT> values_;
+
+	static constexpr size_t max_filter_words = 32*1024;	// 256 KiB
+	std::vector<uint64_t> filter_;
+	size_t filter_mask_ = 0;
+
+	static uint64_t filter_hash(uint64_t key) {	// MurmurHash3 finalizer
+		key ^= key >> 33; key *= 0xff51afd7ed558ccdULL;
+		key ^= key >> 33; key *= 0xc4ceb9fe1a85ec53ULL;
+		key ^= key >> 33;
+		return key;
+	}
+	static uint64_t filter_bits(uint64_t h) {
+		return (uint64_t(1) << ((h >> 52) & 63)) | (uint64_t(1) << ((h >> 58) & 63));
+	}
+	void filter_add(uint64_t key) {
+		uint64_t h = filter_hash(key);
+		filter_[h & filter_mask_] |= filter_bits(h);
+	}
+
+	size_t slot_of(uint64_t key) const {
+		// Weak hashes are not uniform in their lower bits (RSYNC keeps s1 there), so they are mixed first.
+		return size_t((key * 0x9E3779B97F4A7C15ULL) >> 32) & mask_;
+	}
+
+	void place(uint64_t key, uint32_t number) {
+		filter_add(key);
+
+		size_t slot = slot_of(key);
+		while(slots_[slot].number != 0) slot = (slot+1) & mask_;
+		slots_[slot] = {key, number};
+	}
+
+	void rehash(size_t min_slots) {
+		size_t slot_count = 16;
+		while(slot_count < min_slots) slot_count *= 2;
+
+		slots_.assign(slot_count, Slot{0, 0});
+		mask_ = slot_count-1;
+
+		// About 16 filter bits per value. slot_count is twice the expected number of values.
+		size_t filter_words = 1;
+		while(filter_words < slot_count/8 && filter_words < max_filter_words) filter_words *= 2;
+		filter_.assign(filter_words, 0);
+		filter_mask_ = filter_words-1;
+
+		for(size_t n = 0; n < keys_.size(); n++)
+			place(keys_[n], uint32_t(n+1));
+	}
+};
+
+template<class ValueT>
+constexpr size_t WeakHashIndex<ValueT>::npos;
+
+} /* namespace internals */
+} /* namespace cryptodiff */
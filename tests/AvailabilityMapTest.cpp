@@ -0,0 +1,117 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "util/AvailabilityMap.h"
+#include <random>
+#include <gtest/gtest.h>
+
+using namespace cryptodiff;
+
+TEST(FlatMapTest, InsertKeepsKeysSortedAndUnique) {
+	FlatMap<int, int> map;
+	for(int key : {5, 1, 9, 3, 7}) EXPECT_TRUE(map.insert({key, key*10}).second);
+
+	auto duplicate = map.insert({3, 0});
+	EXPECT_FALSE(duplicate.second);
+	EXPECT_EQ(30, duplicate.first->second);
+
+	std::vector<int> keys;
+	for(auto& value : map) keys.push_back(value.first);
+	EXPECT_EQ((std::vector<int>{1, 3, 5, 7, 9}), keys);
+}
+
+TEST(FlatMapTest, BoundsAndErase) {
+	FlatMap<int, int> map;
+	for(int key : {10, 20, 30}) map.insert({key, 0});
+
+	EXPECT_EQ(20, map.lower_bound(20)->first);
+	EXPECT_EQ(30, map.upper_bound(20)->first);
+	EXPECT_EQ(10, map.lower_bound(5)->first);
+	EXPECT_EQ(map.end(), map.upper_bound(30));
+
+	auto next = map.erase(map.lower_bound(20));
+	EXPECT_EQ(30, next->first);
+	EXPECT_EQ(2u, map.size());
+}
+
+TEST(FlatMapTest, EmplaceHintIgnoresWrongHint) {
+	FlatMap<int, int> map;
+	for(int key : {10, 20, 30}) map.insert({key, 0});
+
+	map.emplace_hint(map.lower_bound(20), {15, 0});	// Right hint
+	map.emplace_hint(map.begin(), {25, 0});	// Wrong hint, falls back to search
+	map.emplace_hint(map.end(), {40, 0});
+
+	std::vector<int> keys;
+	for(auto& value : map) keys.push_back(value.first);
+	EXPECT_EQ((std::vector<int>{10, 15, 20, 25, 30, 40}), keys);
+}
+
+TEST(AvailabilityMapTest, InsertSlicesFreeSpace) {
+	AvailabilityMap<uint64_t> av_map(100);
+	EXPECT_TRUE(av_map.empty());
+
+	EXPECT_TRUE(av_map.insert({10, 20}).second);
+	EXPECT_TRUE(av_map.insert({0, 10}).second);
+	EXPECT_TRUE(av_map.insert({90, 10}).second);
+	EXPECT_EQ(60u, av_map.size_left());
+
+	std::vector<std::pair<uint64_t, uint64_t>> spaces(av_map.begin(), av_map.end());
+	EXPECT_EQ((std::vector<std::pair<uint64_t, uint64_t>>{{30, 60}}), spaces);
+
+	EXPECT_TRUE(av_map.insert({30, 60}).second);
+	EXPECT_TRUE(av_map.full());
+	EXPECT_EQ(0u, av_map.ranges());
+}
+
+TEST(AvailabilityMapTest, RejectsTakenOrOutOfRangeBlocks) {
+	AvailabilityMap<uint64_t> av_map(100);
+	ASSERT_TRUE(av_map.insert({40, 20}).second);
+
+	EXPECT_FALSE(av_map.insert({50, 5}).second);	// Inside a taken block
+	EXPECT_FALSE(av_map.insert({30, 20}).second);	// Overlaps a taken block
+	EXPECT_FALSE(av_map.insert({90, 20}).second);	// Past the end
+	EXPECT_FALSE(av_map.insert({100, 1}).second);
+	EXPECT_EQ(80u, av_map.size_left());
+}
+
+TEST(AvailabilityMapTest, FindRange) {
+	AvailabilityMap<uint64_t> av_map(100);
+	av_map.insert({20, 10});
+	av_map.insert({50, 10});	// Free: [0, 20), [30, 50), [60, 100)
+
+	auto range = av_map.find_range(25, 30);
+	std::vector<std::pair<uint64_t, uint64_t>> overlapping(range.first, range.second);
+	EXPECT_EQ((std::vector<std::pair<uint64_t, uint64_t>>{{30, 20}}), overlapping);
+
+	range = av_map.find_range(10, 60);
+	overlapping.assign(range.first, range.second);
+	EXPECT_EQ((std::vector<std::pair<uint64_t, uint64_t>>{{0, 20}, {30, 20}, {60, 40}}), overlapping);
+}
+
+// FlatMap backed map behaves like one backed by std::map
+TEST(AvailabilityMapTest, FlatMapMatchesStdMap) {
+	AvailabilityMap<uint64_t> flat_map(1000000);
+	AvailabilityMap<uint64_t, std::map<uint64_t, uint64_t>> std_map(1000000);
+
+	std::mt19937 rng(1);
+	for(int i = 0; i < 5000; i++){
+		std::pair<uint64_t, uint64_t> block(rng() % 1000000, rng() % 1000 + 1);
+		ASSERT_EQ(std_map.insert(block).second, flat_map.insert(block).second);
+	}
+	EXPECT_EQ(std_map.size_left(), flat_map.size_left());
+	std::vector<std::pair<uint64_t, uint64_t>> flat_spaces(flat_map.begin(), flat_map.end()), std_spaces(std_map.begin(), std_map.end());
+	EXPECT_EQ(std_spaces, flat_spaces);
+}
@@ -0,0 +1,57 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cryptodiff.h"
+#include "TestData.h"
+#include <gtest/gtest.h>
+
+using namespace cryptodiff;
+using namespace cryptodiff::tests;
+
+namespace {
+
+const std::vector<uint8_t> test_key(32, 0x42);
+
+} /* namespace */
+
+TEST(BatchSignerTest, ResultsKeepConcurrency) {
+	std::vector<std::unique_ptr<TempFile>> files;
+	std::vector<std::string> paths;
+	for(uint32_t i = 0; i < 6; i++){
+		files.emplace_back(new TempFile(make_random_data(300*1024+i, i)));
+		paths.push_back(files.back()->path());
+	}
+
+	FileMap prototype(test_key);
+	prototype.set_maxblocksize(64*1024);
+	prototype.set_concurrency(3);
+	BatchSigner signer(prototype);
+	signer.set_concurrency(2);
+
+	std::vector<FileMap> created = signer.create(paths);
+	ASSERT_EQ(paths.size(), created.size());
+	for(size_t i = 0; i < created.size(); i++){
+		EXPECT_EQ(3u, created[i].concurrency());
+		EXPECT_EQ(300*1024+i, created[i].filesize());
+		created[i].set_concurrency(unsigned(i+1));
+	}
+
+	std::vector<FileMap> updated = signer.update(created, paths);
+	ASSERT_EQ(paths.size(), updated.size());
+	for(size_t i = 0; i < updated.size(); i++){
+		EXPECT_EQ(unsigned(i+1), updated[i].concurrency());
+		EXPECT_TRUE(updated[i].delta(created[i]).empty());	// Files are unchanged
+	}
+}
@@ -0,0 +1,106 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cryptodiff.h"
+#include "TestData.h"
+#include <gtest/gtest.h>
+
+using namespace cryptodiff;
+using namespace cryptodiff::tests;
+
+namespace {
+
+const std::vector<uint8_t> test_key(32, 0x42);
+
+FileMap make_map(WeakHashType weak_hash_type = RSYNC) {
+	FileMap map(test_key);
+	map.set_maxblocksize(64*1024);
+	map.set_weak_hash_type(weak_hash_type);
+	return map;
+}
+
+} /* namespace */
+
+TEST(BlockIndexTest, AddKeepsDistinctBlocks) {
+	auto shared = make_random_data(4*64*1024);
+	auto data = shared;
+	data.insert(data.end(), shared.begin(), shared.end());	// Every block twice
+	TempFile file(data);
+	FileMap map = make_map();
+	map.create(file.path());
+
+	BlockIndex index(make_map());
+	index.add(map);
+	EXPECT_EQ(4u, index.size());
+	index.add(map);
+	EXPECT_EQ(4u, index.size());
+
+	auto other_data = make_random_data(3*64*1024, 2);
+	other_data.insert(other_data.end(), shared.begin(), shared.begin()+64*1024);	// One of the blocks above
+	file.write(other_data);
+	FileMap other_map = make_map();
+	other_map.create(file.path());
+	index.add(other_map);
+	EXPECT_EQ(7u, index.size());
+
+	FileMap other_key_map(std::vector<uint8_t>(32, 0x43));
+	EXPECT_THROW(index.add(other_key_map), error);
+}
+
+TEST(BlockIndexTest, MapsTakeBlocksFromIndex) {
+	auto data = make_random_data(10*64*1024);
+	TempFile file(data);
+	FileMap map = make_map();
+	map.create(file.path());
+	BlockIndex index(make_map());
+	index.add(map);
+
+	// Same data in another file is signed with the blocks of the first one
+	data.erase(data.begin(), data.begin()+64*1024);
+	TempFile other_file(data);
+	FileMap other_map = make_map();
+	other_map.set_block_index(index);
+	other_map.create(other_file.path());
+	EXPECT_EQ(9u, other_map.blocks().size());
+	EXPECT_TRUE(other_map.delta(map).empty());
+	EXPECT_EQ(10u, index.size());	// Not added to the index by itself
+
+	FileMap rsync64_map = make_map(RSYNC64);
+	EXPECT_THROW(rsync64_map.set_block_index(index), error);
+}
+
+TEST(BlockIndexTest, DeserializeRejectsOtherHashTypes) {
+	TempFile file(make_random_data(5*64*1024));
+	FileMap map = make_map();
+	map.create(file.path());
+	BlockIndex index(make_map());
+	index.add(map);
+
+	BlockIndex loaded(make_map());
+	loaded.deserialize(index.serialize());
+	EXPECT_EQ(5u, loaded.size());
+
+	FileMap rsync64_map = make_map(RSYNC64);
+	rsync64_map.create(file.path());
+	BlockIndex rsync64_index(rsync64_map);
+	rsync64_index.add(rsync64_map);
+	EXPECT_THROW(loaded.deserialize(rsync64_index.serialize()), error);
+
+	FileMap blake2b_map = make_map();
+	blake2b_map.set_strong_hash_type(BLAKE2B_224);
+	EXPECT_THROW(loaded.deserialize(BlockIndex(blake2b_map).serialize()), error);
+
+	EXPECT_EQ(5u, loaded.size());	// Left as it was
+}
@@ -0,0 +1,113 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "util/BufferPool.h"
+#include "util/ThreadPool.h"
+#include <atomic>
+#include <deque>
+#include <gtest/gtest.h>
+
+using namespace cryptodiff::internals;
+
+TEST(BufferPoolTest, TryAcquireFailsWhenFull) {
+	BufferPool pool(100);
+	BufferPool::Buffer first, second, third;
+	ASSERT_TRUE(pool.try_acquire(60, first));
+	EXPECT_EQ(60u, first->size());
+	EXPECT_FALSE(pool.try_acquire(50, second));
+	EXPECT_TRUE(pool.try_acquire(40, second));
+
+	first.release();
+	EXPECT_TRUE(pool.try_acquire(50, third));
+}
+
+TEST(BufferPoolTest, OversizedRequestGrantedWhenIdle) {
+	BufferPool pool(100);
+	BufferPool::Buffer small, large;
+	ASSERT_TRUE(pool.try_acquire(10, small));
+	EXPECT_FALSE(pool.try_acquire(200, large));
+	small.release();
+	EXPECT_TRUE(pool.try_acquire(200, large));
+	EXPECT_FALSE(pool.try_acquire(1, small));
+}
+
+TEST(BufferPoolTest, ReservationCountsAgainstBudget) {
+	BufferPool pool(100);
+	BufferPool::Buffer first, second;
+	{
+		BufferPool::Reservation reservation(&pool, 80);
+		ASSERT_TRUE(pool.try_acquire(10, first));
+		EXPECT_FALSE(pool.try_acquire(30, second));
+	}
+	EXPECT_TRUE(pool.try_acquire(90, second));
+}
+
+// A thread holding a reservation for its read-ahead must not wait forever for a block, larger than the rest
+TEST(BufferPoolTest, OversizedRequestGrantedWithOnlyReservations) {
+	BufferPool pool(100);
+	BufferPool::Reservation reservation(&pool, 80);
+	BufferPool::Buffer large, small;
+	EXPECT_TRUE(pool.try_acquire(50, large));
+	EXPECT_FALSE(pool.try_acquire(1, small));
+}
+
+// Recycled buffer is charged with its capacity, so a small request must not get a large buffer, that doesn't fit
+TEST(BufferPoolTest, RecycledBuffersStayWithinBudget) {
+	BufferPool pool(100);
+	BufferPool::Buffer large, small, other;
+	ASSERT_TRUE(pool.try_acquire(70, large));
+	large.release();	// Kept for recycling
+
+	ASSERT_TRUE(pool.try_acquire(40, small));
+	ASSERT_TRUE(pool.try_acquire(10, other));
+	size_t charged = small->capacity() + other->capacity();
+	EXPECT_LE(charged, 100u);
+	// Whatever is charged, the rest of the budget is still available
+	BufferPool::Buffer rest;
+	EXPECT_TRUE(pool.try_acquire(100-charged, rest));
+}
+
+// Buffers in use never exceed the budget, with producers waiting for workers to return buffers
+TEST(BufferPoolTest, ConcurrentUseStaysWithinBudget) {
+	const size_t block_size = 64*1024, limit = 5*block_size;
+	BufferPool pool(limit);
+	ThreadPool workers(8);
+
+	std::atomic<size_t> in_use(0), peak(0);
+	std::deque<std::future<void>> inflight;
+	for(int i = 0; i < 2000; i++){
+		size_t size = (i % 7 == 0) ? block_size/2 : block_size;
+		BufferPool::Buffer buffer;
+		if(!pool.try_acquire(size, buffer)){
+			while(!inflight.empty()){inflight.front().get(); inflight.pop_front();}	// Must not wait with buffers of our own
+			buffer = pool.acquire(size);
+		}
+
+		size_t now = (in_use += buffer->capacity());
+		size_t previous_peak = peak;
+		while(now > previous_peak && !peak.compare_exchange_weak(previous_peak, now));
+
+		if(inflight.size() >= 16){inflight.front().get(); inflight.pop_front();}
+		inflight.push_back(workers.post([&in_use, buffer = std::move(buffer)]() mutable {
+			in_use -= buffer->capacity();
+			buffer.release();
+		}));
+	}
+	while(!inflight.empty()){inflight.front().get(); inflight.pop_front();}
+
+	EXPECT_LE(peak.load(), limit);
+	BufferPool::Buffer whole;
+	EXPECT_TRUE(pool.try_acquire(limit, whole));	// Everything returned
+}
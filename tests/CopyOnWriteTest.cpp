@@ -0,0 +1,60 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "util/CopyOnWrite.h"
+#include <type_traits>
+#include <vector>
+#include <gtest/gtest.h>
+
+using namespace cryptodiff::internals;
+
+static_assert(std::is_nothrow_move_constructible<CopyOnWrite<std::vector<int>>>::value, "Moves must not allocate");
+static_assert(std::is_nothrow_move_assignable<CopyOnWrite<std::vector<int>>>::value, "Moves must not allocate");
+
+TEST(CopyOnWriteTest, CopiesShareUntilWritten) {
+	CopyOnWrite<std::vector<int>> original;
+	original.write() = {1, 2, 3};
+
+	CopyOnWrite<std::vector<int>> copy = original;
+	EXPECT_EQ(&*original, &*copy);
+
+	copy.write().push_back(4);
+	EXPECT_NE(&*original, &*copy);
+	EXPECT_EQ((std::vector<int>{1, 2, 3}), *original);
+	EXPECT_EQ((std::vector<int>{1, 2, 3, 4}), *copy);
+
+	const std::vector<int>* unshared = &*copy;
+	copy.write().push_back(5);	// Not shared anymore, so not copied again
+	EXPECT_EQ(unshared, &*copy);
+}
+
+TEST(CopyOnWriteTest, MovedFromIsEmptyAndUsable) {
+	CopyOnWrite<std::vector<int>> original;
+	original.write() = {1, 2, 3};
+	const std::vector<int>* value = &*original;
+
+	CopyOnWrite<std::vector<int>> moved = std::move(original);
+	EXPECT_EQ(value, &*moved);
+	EXPECT_TRUE(original->empty());
+
+	original.write().push_back(7);	// Gets a value of its own
+	EXPECT_EQ((std::vector<int>{7}), *original);
+	EXPECT_EQ((std::vector<int>{1, 2, 3}), *moved);
+
+	moved = std::move(original);
+	EXPECT_EQ((std::vector<int>{7}), *moved);
+	EXPECT_TRUE(original->empty());
+	EXPECT_TRUE(original.reset().empty());
+}
@@ -0,0 +1,92 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "crypto/FastCDC.h"
+#include "TestData.h"
+#include <gtest/gtest.h>
+
+using namespace cryptodiff::tests;
+
+namespace {
+
+// Absolute offsets of chunk ends
+std::vector<size_t> cut_points(const FastCDC& chunker, const std::vector<uint8_t>& data) {
+	std::vector<size_t> cuts;
+	for(size_t offset = 0; offset < data.size();){
+		offset += chunker.cut(data.data()+offset, data.size()-offset);
+		cuts.push_back(offset);
+	}
+	return cuts;
+}
+
+} /* namespace */
+
+TEST(FastCDCTest, ChunkSizesWithinLimits) {
+	FastCDC chunker(8*1024, 64*1024);
+	auto data = make_random_data(4*1024*1024);
+	auto cuts = cut_points(chunker, data);
+
+	size_t previous = 0;
+	for(size_t i = 0; i < cuts.size(); i++){
+		size_t size = cuts[i]-previous;
+		EXPECT_LE(size, chunker.max_size());
+		if(i+1 != cuts.size()){
+			EXPECT_GE(size, chunker.min_size());	// Last chunk is cut by the end of data
+		}
+		previous = cuts[i];
+	}
+	EXPECT_EQ(data.size(), cuts.back());
+}
+
+TEST(FastCDCTest, ShortDataIsOneChunk) {
+	FastCDC chunker(8*1024, 64*1024);
+	auto data = make_random_data(8*1024);
+	EXPECT_EQ(data.size(), chunker.cut(data.data(), data.size()));
+	EXPECT_EQ(0u, chunker.cut(data.data(), 0));
+}
+
+TEST(FastCDCTest, BoundariesAreDeterministic) {
+	auto data = make_random_data(1024*1024);
+	EXPECT_EQ(cut_points(FastCDC(4*1024, 32*1024), data), cut_points(FastCDC(4*1024, 32*1024), data));
+}
+
+// After an insertion, chunking synchronizes with the original cut points and stays synchronized.
+TEST(FastCDCTest, BoundariesStableUnderInsertion) {
+	FastCDC chunker(4*1024, 32*1024);
+	auto data = make_random_data(2*1024*1024);
+	auto original_cuts = cut_points(chunker, data);
+
+	const size_t insert_offset = 300*1024;
+	auto inserted = make_random_data(100, 2);
+	auto modified = data;
+	modified.insert(modified.begin()+insert_offset, inserted.begin(), inserted.end());
+	auto modified_cuts = cut_points(chunker, modified);
+
+	// Cut points before the insertion are unchanged
+	for(size_t i = 0; i < original_cuts.size() && original_cuts[i] <= insert_offset - chunker.max_size(); i++)
+		ASSERT_EQ(original_cuts[i], modified_cuts[i]);
+
+	// Cut points after the synchronization are the original ones, shifted by the insertion
+	auto sync_it = std::find_if(modified_cuts.begin(), modified_cuts.end(), [&](size_t cut){
+		return cut > insert_offset+inserted.size() && std::binary_search(original_cuts.begin(), original_cuts.end(), cut-inserted.size());
+	});
+	ASSERT_NE(modified_cuts.end(), sync_it);
+	EXPECT_LT(*sync_it, insert_offset + 4*chunker.max_size());
+
+	auto original_it = std::lower_bound(original_cuts.begin(), original_cuts.end(), *sync_it-inserted.size());
+	ASSERT_EQ(size_t(original_cuts.end()-original_it), size_t(modified_cuts.end()-sync_it));
+	for(; sync_it != modified_cuts.end(); ++sync_it, ++original_it)
+		ASSERT_EQ(*original_it+inserted.size(), *sync_it);
+}
@@ -0,0 +1,139 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "util/File.h"
+#include "TestData.h"
+#include <gtest/gtest.h>
+#include <thread>
+
+using namespace cryptodiff::internals;
+using namespace cryptodiff::tests;
+
+namespace {
+
+enum BackendType {STREAM, PREAD, IO_URING};
+
+std::unique_ptr<FileBackend> open_backend(BackendType type, const std::string& path) {
+	switch(type){
+#ifdef CRYPTODIFF_HAVE_PREAD
+		case PREAD: return std::unique_ptr<FileBackend>(new PreadFileBackend(path));
+#endif
+#ifdef CRYPTODIFF_WITH_IO_URING
+		case IO_URING: return std::unique_ptr<FileBackend>(new IoUringFileBackend(path, 8));	// Shallow, to wrap around
+#endif
+		default: return std::unique_ptr<FileBackend>(new StreamFileBackend(path));
+	}
+}
+
+std::vector<BackendType> available_backends() {
+	std::vector<BackendType> types{STREAM};
+#ifdef CRYPTODIFF_HAVE_PREAD
+	types.push_back(PREAD);
+#endif
+#ifdef CRYPTODIFF_WITH_IO_URING
+	types.push_back(IO_URING);
+#endif
+	return types;
+}
+
+class FileBackendTest : public ::testing::TestWithParam<BackendType> {
+protected:
+	FileBackendTest() : data_(make_random_data(8*1024*1024+123)), file_(data_) {}
+
+	std::vector<uint8_t> data_;
+	TempFile file_;
+};
+
+} /* namespace */
+
+TEST_P(FileBackendTest, Size) {
+	EXPECT_EQ(data_.size(), open_backend(GetParam(), file_.path())->size());
+}
+
+TEST_P(FileBackendTest, BatchMatchesFile) {
+	auto backend = open_backend(GetParam(), file_.path());
+
+	std::mt19937 rng(3);
+	std::vector<std::vector<uint8_t>> buffers;
+	std::vector<FileBackend::ReadRequest> requests;
+	for(int i = 0; i < 100; i++){
+		uint32_t size = (i % 10 == 0) ? 0 : rng() % (1024*1024);	// Empty and multi-piece requests too
+		uint64_t offset = rng() % (data_.size()-size+1);
+		buffers.emplace_back(size);
+		requests.push_back({offset, size, buffers.back().data()});
+	}
+	backend->read_batch(requests);
+
+	for(size_t i = 0; i < requests.size(); i++)
+		ASSERT_TRUE(std::equal(buffers[i].begin(), buffers[i].end(), data_.begin()+requests[i].offset)) << "request " << i;
+}
+
+TEST_P(FileBackendTest, LargeReadMatchesFile) {
+	auto backend = open_backend(GetParam(), file_.path());
+	std::vector<uint8_t> buffer(File::sequential_read_size+77);
+	backend->read(12345, (uint32_t)buffer.size(), buffer.data());
+	EXPECT_TRUE(std::equal(buffer.begin(), buffer.end(), data_.begin()+12345));
+}
+
+TEST_P(FileBackendTest, ReadPastEndThrows) {
+	auto backend = open_backend(GetParam(), file_.path());
+	std::vector<uint8_t> buffer(10);
+	std::vector<FileBackend::ReadRequest> requests{{data_.size()-5, 10, buffer.data()}};
+	EXPECT_THROW(backend->read_batch(requests), std::ios_base::failure);
+}
+
+TEST_P(FileBackendTest, ReadsAfterFailedBatch) {
+	auto backend = open_backend(GetParam(), file_.path());
+
+	// Reads past the end fail the batch, while the rest of it is queued behind them
+	std::vector<std::vector<uint8_t>> buffers(40, std::vector<uint8_t>(4096));
+	std::vector<FileBackend::ReadRequest> requests{{data_.size()-5, 4096, buffers[0].data()}};
+	for(size_t i = 1; i < buffers.size(); i++)
+		requests.push_back({i*4096, 4096, buffers[i].data()});
+	EXPECT_THROW(backend->read_batch(requests), std::ios_base::failure);
+
+	std::vector<uint8_t> buffer(100000);
+	backend->read(777, (uint32_t)buffer.size(), buffer.data());
+	EXPECT_TRUE(std::equal(buffer.begin(), buffer.end(), data_.begin()+777));
+}
+
+TEST_P(FileBackendTest, ConcurrentBatchesMatchFile) {
+	auto backend = open_backend(GetParam(), file_.path());
+
+	std::vector<std::thread> threads;
+	std::vector<int> mismatches(4, 0);
+	for(size_t t = 0; t < mismatches.size(); t++)
+		threads.emplace_back([&, t]{
+			std::mt19937 rng((unsigned)t);
+			for(int round = 0; round < 20; round++) {
+				std::vector<std::vector<uint8_t>> buffers;
+				std::vector<FileBackend::ReadRequest> requests;
+				for(int i = 0; i < 30; i++){
+					uint32_t size = rng() % (256*1024);
+					buffers.emplace_back(size);
+					requests.push_back({rng() % (data_.size()-size+1), size, buffers.back().data()});
+				}
+				backend->read_batch(requests);
+				for(size_t i = 0; i < requests.size(); i++)
+					if(!std::equal(buffers[i].begin(), buffers[i].end(), data_.begin()+requests[i].offset)) mismatches[t]++;
+			}
+		});
+	for(auto& thread : threads) thread.join();
+
+	for(int count : mismatches)
+		EXPECT_EQ(0, count);
+}
+
+INSTANTIATE_TEST_SUITE_P(AllBackends, FileBackendTest, ::testing::ValuesIn(available_backends()));
@@ -0,0 +1,331 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "cryptodiff.h"
+#include "TestData.h"
+#include <set>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+#include <gtest/gtest.h>
+
+using namespace cryptodiff;
+using namespace cryptodiff::tests;
+
+static_assert(std::is_nothrow_move_constructible<FileMap>::value && std::is_nothrow_move_assignable<FileMap>::value, "Moves must not allocate");
+
+namespace {
+
+const std::vector<uint8_t> test_key(32, 0x42);
+
+FileMap make_map(ChunkingType chunking_type = FIXED, WeakHashType weak_hash_type = RSYNC) {
+	FileMap map(test_key);
+	map.set_maxblocksize(256*1024);
+	map.set_minblocksize(32*1024);
+	map.set_weak_hash_type(weak_hash_type);
+	map.set_chunking_type(chunking_type);
+	return map;
+}
+
+void expect_blocks_equal(const std::vector<Block>& expected, const std::vector<Block>& actual) {
+	ASSERT_EQ(expected.size(), actual.size());
+	for(size_t i = 0; i < expected.size(); i++){
+		EXPECT_EQ(expected[i].blocksize_, actual[i].blocksize_) << "block " << i;
+		EXPECT_EQ(expected[i].iv_, actual[i].iv_) << "block " << i;
+		EXPECT_EQ(expected[i].encrypted_data_hash_, actual[i].encrypted_data_hash_) << "block " << i;
+		EXPECT_EQ(expected[i].encrypted_rsync_hashes_, actual[i].encrypted_rsync_hashes_) << "block " << i;
+	}
+}
+
+// Sizes of blocks in offset order, and whether each one was taken from old_map. New blocks get random IVs, so maps
+// can be compared only by this.
+std::vector<std::pair<uint32_t, bool>> layout(const FileMap& map, const FileMap& old_map) {
+	std::set<std::vector<uint8_t>> old_ivs;
+	for(auto& block : old_map.blocks()) old_ivs.insert(block.iv_);
+
+	std::vector<std::pair<uint32_t, bool>> result;
+	for(auto& block : map.blocks()) result.emplace_back(block.blocksize_, old_ivs.count(block.iv_) != 0);
+	return result;
+}
+
+size_t reused_count(const std::vector<std::pair<uint32_t, bool>>& layout) {
+	return std::count_if(layout.begin(), layout.end(), [](const std::pair<uint32_t, bool>& block){return block.second;});
+}
+
+} /* namespace */
+
+TEST(FileMapTest, SerializeRoundTrip) {
+	TempFile file(make_random_data(3*1024*1024+17));
+	for(auto chunking_type : {FIXED, FASTCDC}){
+		for(auto weak_hash_type : {RSYNC, RSYNC64}){
+			FileMap map = make_map(chunking_type, weak_hash_type);
+			map.set_strong_hash_type(BLAKE2B_224);
+			map.create(file.path());
+
+			FileMap loaded(test_key);
+			loaded.deserialize(map.serialize());
+			EXPECT_EQ(map.filesize(), loaded.filesize());
+			EXPECT_EQ(map.maxblocksize(), loaded.maxblocksize());
+			EXPECT_EQ(map.minblocksize(), loaded.minblocksize());
+			EXPECT_EQ(map.strong_hash_type(), loaded.strong_hash_type());
+			EXPECT_EQ(map.weak_hash_type(), loaded.weak_hash_type());
+			EXPECT_EQ(map.chunking_type(), loaded.chunking_type());
+			expect_blocks_equal(map.blocks(), loaded.blocks());
+
+			// Decrypted hashes are usable: unchanged file is matched to the loaded blocks
+			FileMap updated = loaded.update(file.path());
+			EXPECT_TRUE(updated.delta(loaded).empty());
+		}
+	}
+}
+
+TEST(FileMapTest, DeserializeRejectsDamagedSignature) {
+	TempFile file(make_random_data(1024*1024));
+	FileMap map = make_map();
+	map.create(file.path());
+	auto serialized = map.serialize();
+
+	FileMap loaded(test_key);
+	loaded.deserialize(serialized);
+
+	auto truncated = serialized;
+	truncated.resize(truncated.size()-1);
+	EXPECT_THROW(loaded.deserialize(truncated), error);
+
+	auto trailing = serialized;
+	trailing.push_back(0);
+	EXPECT_THROW(loaded.deserialize(trailing), error);
+
+	auto bad_magic = serialized;
+	bad_magic[0] ^= 0xFF;
+	EXPECT_THROW(loaded.deserialize(bad_magic), error);
+
+	auto bad_filesize = serialized;
+	bad_filesize[31] ^= 0x01;	// Last byte of filesize in the header
+	EXPECT_THROW(loaded.deserialize(bad_filesize), error);
+
+	// Rejected signatures leave the map as it was
+	EXPECT_EQ(map.filesize(), loaded.filesize());
+	expect_blocks_equal(map.blocks(), loaded.blocks());
+}
+
+TEST(FileMapTest, DeltaHasOnlyChangedBlocks) {
+	auto data = make_random_data(4*1024*1024);
+	TempFile file(data);
+	FileMap old_map = make_map();
+	old_map.create(file.path());
+	EXPECT_TRUE(old_map.delta(old_map).empty());
+	EXPECT_EQ(old_map.blocks().size(), old_map.delta(make_map()).size());	// Random data has no repeated blocks
+
+	auto changed = make_random_data(1000, 2);
+	std::copy(changed.begin(), changed.end(), data.begin()+1024*1024+100);
+	file.write(data);
+	FileMap new_map = old_map.update(file.path());
+
+	auto new_layout = layout(new_map, old_map);
+	auto delta = new_map.delta(old_map);
+	EXPECT_EQ(new_layout.size() - reused_count(new_layout), delta.size());
+	EXPECT_FALSE(delta.empty());
+	EXPECT_LT(delta.size(), new_map.blocks().size());
+
+	std::set<std::vector<uint8_t>> old_ivs;
+	for(auto& block : old_map.blocks()) old_ivs.insert(block.iv_);
+	for(auto& block : delta) EXPECT_EQ(0u, old_ivs.count(block.iv_));
+}
+
+// Worker threads keep signing state between blocks. Maps with different keys, signed at the same time and one after
+// another on the same thread, must each get blocks encrypted with their own key and unique IVs.
+TEST(FileMapTest, BlocksAreSignedWithMapKey) {
+	auto data = make_random_data(2*1024*1024+1000);
+	TempFile file(data);
+	const std::vector<std::vector<uint8_t>> keys{test_key, std::vector<uint8_t>(32, 0x43)};
+
+	std::vector<FileMap> maps;
+	for(auto& key : keys){
+		maps.emplace_back(key);
+		maps.back().set_maxblocksize(64*1024);
+	}
+	std::vector<std::thread> threads;
+	for(auto& map : maps) threads.emplace_back([&]{map.create(file.path());});
+	for(auto& thread : threads) thread.join();
+
+	for(auto& key : keys){	// Signed on the calling thread
+		maps.emplace_back(key);
+		maps.back().set_maxblocksize(64*1024);
+		maps.back().set_concurrency(1);
+		maps.back().create(file.path());
+	}
+
+	std::set<std::vector<uint8_t>> ivs;
+	size_t block_count = 0;
+	for(size_t i = 0; i < maps.size(); i++){
+		uint64_t offset = 0;
+		for(auto& block : maps[i].blocks()){
+			std::vector<uint8_t> block_data(data.begin()+offset, data.begin()+offset+block.blocksize_);
+			auto expected_hash = compute_strong_hash(encrypt_block(block_data, keys[i % keys.size()], block.iv_), maps[i].strong_hash_type());
+			ASSERT_EQ(expected_hash, block.encrypted_data_hash_) << "map " << i << ", offset " << offset;
+
+			ivs.insert(block.iv_);
+			block_count++;
+			offset += block.blocksize_;
+		}
+		EXPECT_EQ(data.size(), offset);
+	}
+	EXPECT_EQ(block_count, ivs.size());
+}
+
+// A stream, read in pieces of any size, gives the same blocks as the file
+TEST(FileMapTest, StreamCreateMatchesFile) {
+	auto data = make_random_data(3*1024*1024+17);
+	TempFile file(data);
+	for(auto chunking_type : {FIXED, FASTCDC}){
+		FileMap from_file = make_map(chunking_type);
+		from_file.create(file.path());
+		auto expected = layout(from_file, make_map());
+
+		std::istringstream stream(std::string(data.begin(), data.end()));
+		FileMap from_stream = make_map(chunking_type);
+		from_stream.create(stream);
+		EXPECT_EQ(expected, layout(from_stream, make_map()));
+
+		size_t position = 0;
+		FileMap from_callback = make_map(chunking_type);
+		from_callback.create([&](uint8_t* buffer, size_t size) -> size_t {
+			size = std::min(std::min(size, data.size()-position), size_t(1000+position%777));	// Short reads
+			std::copy_n(data.begin()+position, size, buffer);
+			position += size;
+			return size;
+		});
+		EXPECT_EQ(expected, layout(from_callback, make_map()));
+	}
+}
+
+TEST(FileMapTest, StreamUpdateReusesBlocks) {
+	auto data = make_random_data(4*1024*1024);
+	TempFile file(data);
+	FileMap old_map = make_map();
+	old_map.create(file.path());
+
+	auto inserted = make_random_data(1000, 2);
+	data.insert(data.begin()+1024*1024+100, inserted.begin(), inserted.end());
+	std::istringstream stream(std::string(data.begin(), data.end()));
+	FileMap new_map = old_map.update(stream);
+
+	EXPECT_EQ(data.size(), new_map.filesize());
+	auto new_layout = layout(new_map, old_map);
+	EXPECT_EQ(old_map.blocks().size()-1, reused_count(new_layout));	// Only the block with the insertion is new
+	uint64_t covered = 0;
+	for(auto& block : new_layout) covered += block.first;
+	EXPECT_EQ(data.size(), covered);
+}
+
+// Copies share blocks, but changing one of them leaves the others as they were
+TEST(FileMapTest, CopiesAndMovesKeepBlocks) {
+	TempFile file(make_random_data(1024*1024));
+	FileMap map = make_map();
+	map.create(file.path());
+	auto blocks = map.blocks();
+
+	FileMap copy = map;
+	expect_blocks_equal(blocks, copy.blocks());
+	TempFile other_file(make_random_data(300*1024, 2));
+	copy.create(other_file.path());
+	EXPECT_EQ(300*1024u, copy.filesize());
+	expect_blocks_equal(blocks, map.blocks());
+
+	FileMap moved = std::move(copy);
+	EXPECT_EQ(300*1024u, moved.filesize());
+	copy = map;	// Moved-from map can be assigned to
+	expect_blocks_equal(blocks, copy.blocks());
+
+	EncFileMap enc_copy = map;
+	EXPECT_EQ(map.filesize(), enc_copy.filesize());
+	expect_blocks_equal(blocks, enc_copy.blocks());
+}
+
+// Large files are scanned in segments in parallel. The result must not depend on the number of threads.
+TEST(FileMapTest, SegmentedUpdateMatchesSerial) {
+	auto data = make_random_data(140*1024*1024);
+	TempFile file(data);
+	FileMap old_map = make_map();
+	old_map.set_maxblocksize(1024*1024);
+	old_map.create(file.path());
+
+	// Shifts blocks across segment boundaries (every 64 MiB), and in the middle of segments
+	for(size_t offset : {size_t(100*1024*1024), size_t(64*1024*1024-3000), size_t(10*1024*1024)}){
+		auto inserted = make_random_data(777, (uint32_t)offset);
+		data.insert(data.begin()+offset, inserted.begin(), inserted.end());
+	}
+	file.write(data);
+
+	old_map.set_concurrency(1);
+	auto serial_layout = layout(old_map.update(file.path()), old_map);
+	old_map.set_concurrency(8);
+	auto parallel_layout = layout(old_map.update(file.path()), old_map);
+
+	EXPECT_EQ(serial_layout, parallel_layout);
+	EXPECT_GT(reused_count(serial_layout), serial_layout.size()*9/10);
+}
+
+// With fixed-size blocks, blocks outside of dirty ranges are exactly those a full update matches. Content-defined chunks
+// may cut differently past the end of a dirty range, so only fixed chunking is compared.
+TEST(FileMapTest, DirtyRangeUpdateMatchesFullUpdate) {
+	auto data = make_random_data(8*1024*1024);
+	TempFile file(data);
+	FileMap old_map = make_map();
+	old_map.create(file.path());
+
+	std::vector<std::pair<uint64_t, uint64_t>> dirty_ranges{{1024*1024+5, 300}, {5*1024*1024-1000, 70000}};
+	for(auto& range : dirty_ranges){
+		auto changed = make_random_data((size_t)range.second, (uint32_t)range.first);
+		std::copy(changed.begin(), changed.end(), data.begin()+range.first);
+	}
+	file.write(data);
+
+	auto full_layout = layout(old_map.update(file.path()), old_map);
+	auto dirty_layout = layout(old_map.update(file.path(), dirty_ranges), old_map);
+	EXPECT_EQ(full_layout, dirty_layout);
+	EXPECT_EQ(dirty_layout.size()-3, reused_count(dirty_layout));	// The range at 5 MiB spans two blocks
+}
+
+// Blocks of all sizes are matched in one pass. At the same offset, a power-of-two block is preferred.
+TEST(FileMapTest, PreferredBlockWinsAtSameOffset) {
+	auto data = make_random_data(256*1024);
+	auto old_data = data;
+	old_data.insert(old_data.end(), data.begin(), data.begin()+10*1024);	// Small block, that repeats the large one
+	TempFile file(old_data);
+	FileMap old_map = make_map();
+	old_map.create(file.path());
+	ASSERT_EQ(2u, old_map.blocks().size());
+
+	file.write(data);
+	std::vector<std::pair<uint32_t, bool>> expected{{256*1024, true}};
+	EXPECT_EQ(expected, layout(old_map.update(file.path()), old_map));
+}
+
+// The leftmost match wins, even if a preferred block starts inside it
+TEST(FileMapTest, LeftmostMatchShadowsOverlappingBlock) {
+	auto data = make_random_data(261*1024);
+	std::vector<uint8_t> old_data(data.begin()+5*1024, data.end());	// Large block at 5 KiB of the new file
+	old_data.insert(old_data.end(), data.begin(), data.begin()+10*1024);	// Small block at 0, overlapping it
+	TempFile file(old_data);
+	FileMap old_map = make_map();
+	old_map.create(file.path());
+	ASSERT_EQ(2u, old_map.blocks().size());
+
+	file.write(data);
+	std::vector<std::pair<uint32_t, bool>> expected{{10*1024, true}, {251*1024, false}};
+	EXPECT_EQ(expected, layout(old_map.update(file.path()), old_map));
+}
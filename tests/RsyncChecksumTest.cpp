@@ -0,0 +1,94 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "crypto/RsyncChecksum.h"
+#include "TestData.h"
+#include <gtest/gtest.h>
+
+using namespace cryptodiff::tests;
+
+template<class ChecksumT>
+class RsyncChecksumTest : public ::testing::Test {};
+using ChecksumTypes = ::testing::Types<RsyncChecksum, RsyncChecksum64>;
+TYPED_TEST_SUITE(RsyncChecksumTest, ChecksumTypes);
+
+// Iterator version is the scalar reference, pointer version uses a vectorized kernel, if the CPU has one
+TYPED_TEST(RsyncChecksumTest, VectorizedMatchesScalar) {
+	auto data = make_random_data(1024*1024+64);
+	std::vector<size_t> sizes;
+	for(size_t size = 0; size <= 300; size++) sizes.push_back(size);
+	for(size_t size : {1023, 1024, 4097, 65536+13, 1024*1024}) sizes.push_back(size);
+
+	for(size_t size : sizes){
+		for(size_t misalignment : {0, 1, 3, 15, 31}){
+			const uint8_t* first = data.data()+misalignment;
+			typename TypeParam::weakhash_type scalar = TypeParam(first, first+size);
+			typename TypeParam::weakhash_type vectorized = TypeParam(first, size);
+			ASSERT_EQ(scalar, vectorized) << "size " << size << ", misalignment " << misalignment;
+		}
+	}
+}
+
+// Sums must wrap the same way in both versions
+TYPED_TEST(RsyncChecksumTest, VectorizedMatchesScalarOnSaturatedData) {
+	std::vector<uint8_t> data(4*1024*1024+7, 0xFF);
+	typename TypeParam::weakhash_type scalar = TypeParam(data.begin(), data.end());
+	typename TypeParam::weakhash_type vectorized = TypeParam(data.data(), data.size());
+	EXPECT_EQ(scalar, vectorized);
+}
+
+TYPED_TEST(RsyncChecksumTest, UpdateInPiecesMatchesCompute) {
+	auto data = make_random_data(100000);
+	TypeParam pieces;
+	size_t offset = 0;
+	for(size_t piece : {0, 1, 7, 64, 1000, 33333}){
+		pieces.update(data.data()+offset, piece);
+		offset += piece;
+	}
+	pieces.update(data.data()+offset, data.size()-offset);
+	EXPECT_EQ(pieces.value(), TypeParam(data.data(), data.size()).value());
+}
+
+TYPED_TEST(RsyncChecksumTest, RollMatchesCompute) {
+	auto data = make_random_data(20000);
+	const size_t window = 4096;
+	TypeParam rolling(data.data(), window);
+	for(size_t offset = 1; offset+window <= data.size(); offset++){
+		rolling.roll(data[offset-1], data[offset+window-1]);
+		ASSERT_EQ(rolling.value(), TypeParam(data.data()+offset, window).value()) << "offset " << offset;
+	}
+}
+
+TYPED_TEST(RsyncChecksumTest, PrefixSumsMatchCompute) {
+	auto data = make_random_data(50000);
+	RsyncPrefixSums sums;
+	sums.append(data.data(), 20000);
+	sums.append(data.data()+20000, data.size()-20000);
+
+	size_t discarded = 0;
+	for(size_t discard : {0, 1, 12345}){
+		sums.discard(discard);
+		discarded += discard;
+		for(size_t pos : {0, 1, 100, 7777}){
+			for(size_t size : {1, 31, 4096, 20000}){
+				uint32_t s1, s2;
+				sums.window_sums(pos, size, s1, s2);
+				TypeParam from_sums;
+				from_sums.assign(s1, s2, size);
+				ASSERT_EQ(from_sums.value(), TypeParam(data.data()+discarded+pos, size).value()) << "position " << discarded+pos << ", size " << size;
+			}
+		}
+	}
+}
@@ -0,0 +1,61 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#pragma once
+#include <cstdint>
+#include <fstream>
+#include <random>
+#include <string>
+#include <vector>
+#include <boost/filesystem.hpp>
+
+namespace cryptodiff {
+namespace tests {
+
+// Pseudo-random bytes, the same for the same seed
+inline std::vector<uint8_t> make_random_data(size_t size, uint32_t seed = 1) {
+	std::vector<uint8_t> data(size);
+	std::mt19937 rng(seed);
+	for(auto& byte : data) byte = (uint8_t)rng();
+	return data;
+}
+
+/* File in the temporary directory, removed on destruction */
+class TempFile {
+public:
+	TempFile() : path_(boost::filesystem::temp_directory_path() / boost::filesystem::unique_path("cryptodiff-test-%%%%-%%%%-%%%%")) {}
+	TempFile(const std::vector<uint8_t>& data) : TempFile() {write(data);}
+	TempFile(const TempFile&) = delete;
+	TempFile& operator=(const TempFile&) = delete;
+	~TempFile() {
+		boost::system::error_code ec;
+		boost::filesystem::remove(path_, ec);
+	}
+
+	std::string path() const {return path_.string();}
+
+	// Replaces contents of the file
+	void write(const std::vector<uint8_t>& data) {
+		std::ofstream ofs(path(), std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+		ofs.exceptions(std::ios::failbit | std::ios::badbit);
+		ofs.write(reinterpret_cast<const char*>(data.data()), data.size());
+	}
+
+private:
+	boost::filesystem::path path_;
+};
+
+} /* namespace tests */
+} /* namespace cryptodiff */
@@ -0,0 +1,101 @@
+/* Copyright (C) 2015 Alexander Shishenko <GamePad64@gmail.com>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "util/WeakHashIndex.h"
+#include <algorithm>
+#include <random>
+#include <gtest/gtest.h>
+
+using namespace cryptodiff::internals;
+
+namespace {
+
+// Keys like RSYNC checksums: s2 in the upper 16 bits, s1 in the lower ones, many of them sharing low bits
+std::vector<uint64_t> make_keys(size_t count, uint32_t seed) {
+	std::mt19937 rng(seed);
+	std::vector<uint64_t> keys(count);
+	for(auto& key : keys) key = (uint64_t(rng() & 0xFFFF) << 16) | (rng() & 0xFF);
+	return keys;
+}
+
+// Value numbers of all values with key
+std::vector<size_t> find_all(const WeakHashIndex<int>& index, uint64_t key) {
+	std::vector<size_t> found;
+	index.find_if(key, [&](size_t n){found.push_back(n); return false;});
+	std::sort(found.begin(), found.end());
+	return found;
+}
+
+} /* namespace */
+
+TEST(WeakHashIndexTest, FindsEveryValueOfKey) {
+	auto keys = make_keys(10000, 1);
+	for(size_t n = 0; n < 1000; n++) keys[n] = keys[n+5000];	// Repeated keys
+
+	WeakHashIndex<int> index;	// Grows while inserting
+	for(size_t n = 0; n < keys.size(); n++) index.insert(keys[n], (int)n);
+	ASSERT_EQ(keys.size(), index.size());
+
+	for(size_t n = 0; n < keys.size(); n++){
+		EXPECT_EQ((int)n, index[n]);
+		EXPECT_EQ(keys[n], index.key(n));
+
+		std::vector<size_t> expected;
+		for(size_t m = 0; m < keys.size(); m++) if(keys[m] == keys[n]) expected.push_back(m);
+		ASSERT_EQ(expected, find_all(index, keys[n])) << "key " << keys[n];
+	}
+}
+
+TEST(WeakHashIndexTest, FindIfStopsAtMatchingValue) {
+	WeakHashIndex<int> index;
+	index.insert(7, 100);
+	index.insert(7, 200);
+	index.insert(8, 300);
+
+	EXPECT_EQ(1u, index.find_if(7, [&](size_t n){return index[n] == 200;}));
+	EXPECT_EQ(index.npos, index.find_if(7, [&](size_t n){return index[n] == 300;}));
+	EXPECT_EQ(index.npos, index.find_if(9, [](size_t){return true;}));
+	EXPECT_TRUE(index.contains(8));
+
+	index.clear();
+	EXPECT_TRUE(index.empty());
+	EXPECT_FALSE(index.contains(7));
+}
+
+// The prefilter may only reject keys, that are not in the index
+TEST(WeakHashIndexTest, FilterHasNoFalseNegatives) {
+	for(size_t count : {size_t(1), size_t(100), size_t(100000), size_t(1000000)}){	// The largest one hits the filter size cap
+		auto keys = make_keys(count, (uint32_t)count);
+		WeakHashIndex<int> index;
+		index.reserve(count/2);	// Grows past the reserved size too
+		for(size_t n = 0; n < keys.size(); n++) index.insert(keys[n], (int)n);
+
+		size_t false_negatives = 0;
+		for(auto key : keys) if(!index.may_contain(key) || !index.contains(key)) false_negatives++;
+		EXPECT_EQ(0u, false_negatives) << count << " keys";
+	}
+}
+
+TEST(WeakHashIndexTest, FilterRejectsMostMisses) {
+	WeakHashIndex<int> index;
+	std::mt19937_64 rng(1);
+	for(int n = 0; n < 10000; n++) index.insert(rng(), n);
+
+	size_t passed = 0;
+	const size_t misses = 100000;
+	for(size_t n = 0; n < misses; n++) if(index.may_contain(rng())) passed++;
+	EXPECT_LT(passed, misses/20);
+	EXPECT_FALSE(WeakHashIndex<int>().may_contain(0));
+}